@@ -1,19 +1,22 @@
 #ifndef ALPHABETA_CPP
 #define ALPHABETA_CPP
 #include "../h/alphabeta.h"
+#include "../h/move_picker.h"
 #include <fstream>
+#include <limits>
 
-int AlphaBetaEngine::material_table[MAT_SIZE][MAT_SIZE];
+Value AlphaBetaEngine::material_table[MAT_SIZE][MAT_SIZE];
 bool AlphaBetaEngine::table_loaded = false;
-static const double DISTANCE_TABLE_SCALED[11] = { 
-    0.0, 0.5, 0.3, 0.2, 0.1, 0.05, 0.0, 0.0, 0.0, 0.0, 0.0 
+// 0.5, 0.3, 0.2, 0.1 and 0.05 of a soldier
+static const Value DISTANCE_TABLE_SCALED[11] = { 
+    0, 40, 24, 16, 8, 4, 0, 0, 0, 0, 0 
 };
 // Aggressive safety ramp to protect the last pawn
 // static const double KING_SAFETY_BONUS[6] = { 20.0, 5.0, 2.0, 1.0, 0.0, 0.0 };
 
 static std::ofstream f3_dumper;
 #define RET_LOG(score_expr) { \
-    double _val = (score_expr); \
+    Value _val = (score_expr); \
     if (!time_out_) { \
         if (!f3_dumper.is_open()) f3_dumper.open("f3_scores.csv", std::ios::app); \
         f3_dumper << _val << "\n"; \
@@ -40,15 +43,186 @@ void log_position(int depth, Move best, bool last, bool start) {
     fout.close();
 }
 
-AlphaBetaEngine::AlphaBetaEngine(){
-    zobrist_.init_zobrist();
+// Division rounded towards -infinity / +infinity, _d_ > 0
+static inline int64_t floor_div(int64_t n, int64_t d){
+    return n >= 0 ? n / d : -((-n + d - 1) / d);
+}
+static inline int64_t ceil_div(int64_t n, int64_t d){
+    return -floor_div(-n, d);
+}
 
+// Lazy SMP depth staggering: helper i skips the depths where
+// ((depth + SkipPhase[i]) / SkipSize[i]) is odd, so the threads spread over
+// neighbouring depths instead of all searching the same tree.
+static const int SKIP_SIZE[20]  = { 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4 };
+static const int SKIP_PHASE[20] = { 0, 1, 0, 1, 2, 3, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 6, 7 };
+
+AlphaBetaEngine::AlphaBetaEngine()
+  : tt_(std::make_shared<TranspositionTable>())
+{
+    init_game();
     if(!table_loaded){
         load_material_table();
         table_loaded = true;
     }
 }
 
+AlphaBetaEngine::AlphaBetaEngine(std::shared_ptr<TranspositionTable> tt, std::atomic<bool> *stop, int thread_id)
+  : sampler_(thread_id), tt_(std::move(tt)), thread_id_(thread_id), stop_(stop)
+{
+    init_game();
+}
+
+AlphaBetaEngine::~AlphaBetaEngine(){
+    stop_ponder();
+    stop_helpers();
+}
+
+void AlphaBetaEngine::set_threads(int n){
+    n = std::max(1, std::min(n, MAX_THREADS));
+    stop_helpers();
+    helpers_.clear();
+    for(int i = 1; i < n; i++){
+        helpers_.emplace_back(new AlphaBetaEngine(tt_, stop_, i));
+    }
+}
+
+double AlphaBetaEngine::outcomes_per_chance_node() const{
+    uint64_t nodes = chance_nodes_, outcomes = chance_outcomes_searched_;
+    for(const auto &h : helpers_){
+        nodes += h->chance_nodes_;
+        outcomes += h->chance_outcomes_searched_;
+    }
+    return nodes ? double(outcomes) / nodes : 0.0;
+}
+
+double AlphaBetaEngine::sample_error() const{
+    uint64_t nodes = sampled_chance_nodes_;
+    double error = sample_error_sum_;
+    for(const auto &h : helpers_){
+        nodes += h->sampled_chance_nodes_;
+        error += h->sample_error_sum_;
+    }
+    return nodes ? error / nodes : 0.0;
+}
+
+double AlphaBetaEngine::first_move_cutoff_rate() const{
+    uint64_t cutoffs = cutoffs_, first = first_move_cutoffs_;
+    for(const auto &h : helpers_){
+        cutoffs += h->cutoffs_;
+        first += h->first_move_cutoffs_;
+    }
+    return cutoffs ? double(first) / cutoffs : 0.0;
+}
+
+uint64_t AlphaBetaEngine::aspiration_researches() const{
+    uint64_t researches = aspiration_researches_;
+    for(const auto &h : helpers_){
+        researches += h->aspiration_researches_;
+    }
+    return researches;
+}
+
+double AlphaBetaEngine::tt_hit_rate() const{
+    uint64_t probes = tt_probes_, hits = tt_hits_;
+    for(const auto &h : helpers_){
+        probes += h->tt_probes_;
+        hits += h->tt_hits_;
+    }
+    return probes ? double(hits) / probes : 0.0;
+}
+
+uint64_t AlphaBetaEngine::nodes_searched() const{
+    uint64_t nodes = node_count_.load(std::memory_order_relaxed);
+    for(const auto &h : helpers_){
+        nodes += h->node_count_.load(std::memory_order_relaxed);
+    }
+    return nodes;
+}
+
+void AlphaBetaEngine::start_helpers(const Position &pos, int max_depth){
+    for(auto &h : helpers_){
+        // helpers search with the game state the main thread sees
+        h->ply_count_ = ply_count_;
+        h->no_eat_flip = no_eat_flip;
+        std::memcpy(h->unrevealed_count, unrevealed_count, sizeof(unrevealed_count));
+        std::memcpy(h->prev_revealed_count, prev_revealed_count, sizeof(prev_revealed_count));
+        h->prev_choices_ = prev_choices_;
+        h->params_ = params_;
+        h->node_count_.store(0, std::memory_order_relaxed);
+        h->chance_nodes_ = 0;
+        h->chance_outcomes_searched_ = 0;
+        h->sampled_chance_nodes_ = 0;
+        h->sample_error_sum_ = 0;
+        h->aspiration_researches_ = 0;
+        h->tt_probes_ = 0;
+        h->tt_hits_ = 0;
+        h->cutoffs_ = 0;
+        h->first_move_cutoffs_ = 0;
+        h->time_out_ = false;
+
+        AlphaBetaEngine *helper = h.get();
+        helper_threads_.emplace_back([helper, root = Position(pos), max_depth]() mutable {
+            helper->iterative_deepening(root, max_depth);
+        });
+    }
+}
+
+void AlphaBetaEngine::stop_helpers(){
+    stop_->store(true, std::memory_order_relaxed);
+    for(auto &t : helper_threads_){
+        t.join();
+    }
+    helper_threads_.clear();
+}
+
+void AlphaBetaEngine::ponder(const Position &pos){
+    stop_ponder();
+    if(pos.winner() != NO_COLOR) return;
+    stop_->store(false, std::memory_order_relaxed);
+    ponder_thread_ = std::thread(&AlphaBetaEngine::ponder_search, this, Position(pos));
+}
+
+void AlphaBetaEngine::stop_ponder(){
+    if(!ponder_thread_.joinable()) return;
+    stop_->store(true, std::memory_order_relaxed);
+    ponder_thread_.join();
+}
+
+// Runs on ponder_thread_ until stopped, the clock is the opponent's
+void AlphaBetaEngine::ponder_search(Position pos){
+    start_time_ = std::chrono::steady_clock::now();
+    time_out_ = false;
+    node_count_.store(0, std::memory_order_relaxed);
+    time_limit_ms_ = std::numeric_limits<int>::max();
+    manage_time_ = false;
+    node_limit_ = 0;
+    ponder_pv_length_ = 0;
+    tt_->new_search();
+
+    sync_bag(pos);
+    ponder_root_ = pos;
+    start_helpers(pos, MAX_SEARCH_DEPTH);
+    iterative_deepening(pos, MAX_SEARCH_DEPTH);
+    stop_helpers();
+
+    std::copy(prev_pv_, prev_pv_ + prev_pv_length_, ponder_pv_);
+    ponder_pv_length_ = prev_pv_length_;
+    debug << "ponder: " << nodes_searched() << " nodes\n";
+}
+
+// Whether _pos_ (bag synced) is ponder_root_ after the reply we expected,
+// for a flip only if it also revealed the same piece
+bool AlphaBetaEngine::ponder_hit(const Position &pos) const{
+    if(ponder_pv_length_ == 0) return false;
+    Position expected(ponder_root_);
+    const Move &reply = ponder_pv_[0];
+    bool done = reply.type() == Flipping
+                    ? expected.do_move(reply, pos.peek_piece_at(reply.from()))
+                    : expected.do_move(reply);
+    return done && expected.key() == pos.key();
+}
+
 void AlphaBetaEngine::load_material_table(){
     std::ifstream in("material_scores.bin", std::ios::binary);
     if(!in){
@@ -57,6 +231,14 @@ void AlphaBetaEngine::load_material_table(){
     }
     in.read(reinterpret_cast<char*>(material_table), sizeof(material_table));
     in.close();
+    // the file holds material units, some cells of it garbage: keep them
+    // in the score range so that they neither overflow nor leave the TT's
+    // 16 bits
+    for(auto &row : material_table){
+        for(Value &v : row){
+            v = std::max(V_MIN / VALUE_SCALE, std::min(v, V_MAX / VALUE_SCALE)) * VALUE_SCALE;
+        }
+    }
     debug << "Material table loaded.\n";
 }
 
@@ -76,175 +258,577 @@ void AlphaBetaEngine::update_unrevealed(const Position &pos){
     prev_total_count = cur_total_count;
 }
 
-double AlphaBetaEngine::eval(const Position &pos, const int depth){
-    if(pos.winner() != NO_COLOR){
-        if(pos.winner() == pos.due_up()) return AB_WIN_SCORE + depth;
-        else if(pos.winner() == Mystery) return 0; 
+// The bag of a position read from a FEN is the full piece set, replace it
+// with what is really left face down so that flips and keys use it.
+void AlphaBetaEngine::sync_bag(Position &pos) const{
+    Piece pieces[SQUARE_NB];
+    int n = 0;
+    for(Color c: {Red, Black}){
+        for(int pt = General; pt <= Soldier; pt++){
+            for(int i = 0; i < unrevealed_count[c][pt] && n < SQUARE_NB; i++){
+                pieces[n++] = Piece(c, PieceType(pt));
+            }
+        }
+    }
+    pos.clear_collection();
+    pos.add_collection(pieces, n);
+}
+
+// winner: pos.winner(), which the caller already has
+Value AlphaBetaEngine::eval(const Position &pos, const int depth, const Color winner){
+    if(winner != NO_COLOR){
+        if(winner == pos.due_up()) return AB_WIN_SCORE + depth;
+        else if(winner == Mystery) return 0; 
         else return -(AB_WIN_SCORE + depth);
     }
     return pos_score(pos, pos.due_up());
 }
 
-double AlphaBetaEngine::star1(const Move &mv, const Position &pos, double alpha, double beta, int depth, uint64_t key, Move &dummy_ref, int flip_budget, int cooldown){
-    double vsum = 0;
-    int D = pos.count(Hidden);
+// Star1 over the flip outcomes, with a Star2 probing pass in front of it.
+//
+// The probing pass gets bounds for every outcome cheaply: the TT entry of the
+// child if there is one, and otherwise the stand-pat score of the opponent at
+// the horizon or only the first reply of the opponent above it, both of which
+// can only overstate our score. With those bounds in place of
+// V_MIN / V_MAX for the outcomes not searched yet, the Star1 windows are
+// tighter and a node can fail low before any outcome is fully searched.
+Value AlphaBetaEngine::star1(const Move &mv, Position &pos, Value alpha, Value beta, int depth, Move &dummy_ref, int flip_budget, int cooldown){
+    chance_nodes_++;
 
-    double m = V_MIN, M = V_MAX;
-    double A = D * (alpha - V_MAX);
-    double B = D * (beta - V_MIN);
+    Piece outcome[2 * SHOWN_PIECE_TYPE_NB];
+    int weight[2 * SHOWN_PIECE_TYPE_NB];
+    Value lower[2 * SHOWN_PIECE_TYPE_NB], upper[2 * SHOWN_PIECE_TYPE_NB];
+    int n = 0;
+    int64_t total = 0;
     for(Color c: {Red, Black}){
         for(int pt = Soldier; pt >= General; pt--){
-            if(unrevealed_count[c][pt] <= 0) continue;
-
-            Piece p(c, PieceType(pt));
-            double count = unrevealed_count[c][pt];
-
-            Position copy(pos);
-            copy.clear_collection();
-            Piece force_set[1] = {p};
-            copy.add_collection(force_set, 1);
-            copy.do_move(mv);
-            uint64_t child_key = zobrist_.update_zobrist_hash(key, mv, pos, p);
-            unrevealed_count[c][pt]--;// temporarily decrease count
-            A = A / count + V_MAX;
-            B = B / count + V_MIN;
-
-            double search_alpha = std::max(V_MIN, std::min(A, V_MAX));
-            double search_beta = std::max(V_MIN, std::min(B, V_MAX));
-
-            long double t = -f4(copy, -search_beta, -search_alpha, depth, child_key, dummy_ref, Move(), flip_budget - 1, 0);
-            unrevealed_count[c][pt]++;
-
-            if(t > V_MAX) t = V_MAX;
-            if(t < V_MIN) t = V_MIN;
-
-            double probability = count / D;
-            m = m + (t-V_MIN) * probability;
-            M = M + (t-V_MAX) * probability;
-            if(t >= B){
-                // debug << "Pruned in star1 with t >= B ( t = " << t << " , B = " << B << " )\n";
-                return m;
+            // the bag holds the unrevealed pieces, see sync_bag()
+            int count = pos.bag_count(c, PieceType(pt));
+            if(count <= 0) continue;
+            outcome[n] = Piece(c, PieceType(pt));
+            weight[n] = count;
+            lower[n] = V_MIN;
+            upper[n] = V_MAX;
+            total += count;
+            n++;
+        }
+    }
+    // the bag is empty while the board still has a Hidden square, the flip
+    // tells us nothing then
+    if(total == 0) return eval(pos, depth, pos.winner());
+
+    if(params_.sparse_chance && root_depth_ - depth >= params_.sparse_min_ply && n > params_.sparse_samples){
+        return sample_chance(mv, pos, outcome, weight, n, depth, dummy_ref, flip_budget);
+    }
+
+    // Every sum below is weighted by the piece counts, so it is total times
+    // an expected value and exact. The weights are over the bag rather than
+    // pos.count(Hidden), so that they add up to total even when the bag is
+    // out of step with the board. Sums are only divided by total on return:
+    // rounded up for a fail low and down for a fail high, so the bound still
+    // holds, and to the nearest Value for an exact result.
+    const int64_t alpha_w = alpha * total, beta_w = beta * total;
+    // expected value so far, of the outcomes searched and the bounds of the rest
+    int64_t done = 0, rest_lower = 0, rest_upper = 0;
+    for(int i = 0; i < n; i++){
+        rest_lower += int64_t(weight[i]) * V_MIN;
+        rest_upper += int64_t(weight[i]) * V_MAX;
+    }
+
+    if(params_.star2){
+        // start loading every outcome's cluster before the first probe waits
+        for(int i = 0; i < n; i++){
+            pos.do_move(mv, outcome[i]);
+            tt_->prefetch(pos.key());
+            pos.undo_move();
+        }
+        for(int i = 0; i < n; i++){
+            pos.do_move(mv, outcome[i]);
+            Value child_alpha = -INF, child_beta = INF, tt_value;
+            Move tt_move = Move();
+            if(tt_->probe(pos.key(), child_alpha, child_beta, depth, tt_value, tt_move)){
+                child_alpha = child_beta = tt_value;
             }
-            if(t <= A){
-                // debug << "Pruned in star1 with t <= A ( t = " << t << " , A = " << A << " )\n";
-                return M;
+            lower[i] = std::max(lower[i], std::min(-child_beta, V_MAX));
+            upper[i] = std::min(upper[i], std::max(-child_alpha, V_MIN));
+
+            Color winner = pos.winner();
+            if(winner != NO_COLOR){
+                lower[i] = upper[i] = std::max(V_MIN, std::min(-eval(pos, depth, winner), V_MAX));
+            }
+            else if(depth <= 0){
+                // qsearch lets the opponent stand pat
+                upper[i] = std::max(V_MIN, std::min(-pos_score(pos, pos.due_up()), upper[i]));
             }
-            A = count * (A - t);
-            B = count * (B - t);
-            vsum += t * probability;
+            else if(upper[i] == V_MAX){
+                Move reply = MovePicker(pos, tt_move, Move(), quiet_history(pos)).next_move();
+                if(reply != Move() && reply.type() != Flipping){
+                    // the opponent may have better, so this is an upper bound
+                    int64_t others = rest_upper - int64_t(weight[i]) * upper[i];
+                    Value probe_alpha = Value(std::max<int64_t>(V_MIN, std::min<int64_t>(floor_div(alpha_w - others, weight[i]), V_MAX)));
+                    pos.do_move(reply);
+                    Value t = search_outcome(pos, probe_alpha, V_MAX, depth - 1, dummy_ref, flip_budget - 1, 1);
+                    pos.undo_move();
+                    upper[i] = std::max(V_MIN, std::min(t, upper[i]));
+                }
+            }
+            pos.undo_move();
+            if(time_out_) return 0;
+
+            rest_lower += int64_t(weight[i]) * (lower[i] - V_MIN);
+            rest_upper += int64_t(weight[i]) * (upper[i] - V_MAX);
+            if(rest_upper <= alpha_w) return Value(ceil_div(rest_upper, total));
+            if(rest_lower >= beta_w) return Value(floor_div(rest_lower, total));
         }
     }
 
+    for(int i = 0; i < n; i++){
+        int64_t w = weight[i];
+        rest_lower -= w * lower[i];
+        rest_upper -= w * upper[i];
+        // the value this outcome has to beat for the node to fail high / low
+        int64_t A = floor_div(alpha_w - done - rest_upper, w);
+        int64_t B = ceil_div(beta_w - done - rest_lower, w);
+
+        if(A >= upper[i]) return Value(ceil_div(done + w * upper[i] + rest_upper, total));
+        if(B <= lower[i]) return Value(floor_div(done + w * lower[i] + rest_lower, total));
+
+        Value search_alpha = Value(std::max<int64_t>(V_MIN, std::min<int64_t>(A, V_MAX)));
+        Value search_beta = Value(std::max<int64_t>(V_MIN, std::min<int64_t>(B, V_MAX)));
 
-    return vsum;
+        pos.do_move(mv, outcome[i]);
+        Value t = -search_outcome(pos, -search_beta, -search_alpha, depth, dummy_ref, flip_budget - 1, 0);
+        pos.undo_move();
+        chance_outcomes_searched_++;
+
+        t = std::max(V_MIN, std::min(t, V_MAX));
+
+        if(t >= B){
+            return Value(floor_div(done + w * t + rest_lower, total));
+        }
+        if(t <= A){
+            return Value(ceil_div(done + w * t + rest_upper, total));
+        }
+        done += w * t;
+    }
+
+    return Value(floor_div(2 * done + total, 2 * total));
 }
 
-double AlphaBetaEngine::try_move(const Position &pos, const Move &mv, double alpha, double beta, int depth, uint64_t key, Move &dummy_ref, int flip_budget, int cooldown){
+// Sparse sampling of a chance node: draws sparse_samples outcomes with
+// replacement, each with probability count / bag size, and returns the mean
+// of their values. The mean is an unbiased estimate of the expectation; its
+// standard error goes into sample_error_sum_. Each distinct outcome is
+// searched once, with the full window, since the estimate is not a bound.
+Value AlphaBetaEngine::sample_chance(const Move &mv, Position &pos, const Piece *outcome, const int *count, int n, int depth, Move &dummy_ref, int flip_budget){
+    int total = 0;
+    for(int i = 0; i < n; i++){
+        total += count[i];
+    }
+    int drawn[2 * SHOWN_PIECE_TYPE_NB] = {};
+    int k = std::max(2, params_.sparse_samples);
+    for(int s = 0; s < k; s++){
+        int r = int(sampler_(uint32_t(total)));
+        int i = 0;
+        while(r >= count[i]){
+            r -= count[i++];
+        }
+        drawn[i]++;
+    }
+
+    int64_t sum = 0;
+    double sum_sq = 0;// for the error statistic only, in material units
+    for(int i = 0; i < n; i++){
+        if(!drawn[i]) continue;
+        pos.do_move(mv, outcome[i]);
+        Value t = -search_outcome(pos, V_MIN, V_MAX, depth, dummy_ref, flip_budget - 1, 0);
+        pos.undo_move();
+        if(time_out_) return 0;
+        chance_outcomes_searched_++;
+
+        t = std::max(V_MIN, std::min(t, V_MAX));
+        sum += int64_t(drawn[i]) * t;
+        sum_sq += drawn[i] * (double(t) / VALUE_SCALE) * (double(t) / VALUE_SCALE);
+    }
+
+    double mean = double(sum) / VALUE_SCALE / k;
+    double variance = std::max(0.0, sum_sq / k - mean * mean) * k / (k - 1);
+    sampled_chance_nodes_++;
+    sample_error_sum_ += std::sqrt(variance / k);
+    return Value(floor_div(2 * sum + k, 2 * int64_t(k)));
+}
+
+// NT is the type of the child, flips leave it to star1
+template<NodeType NT>
+Value AlphaBetaEngine::try_move(Position &pos, const Move &mv, Value alpha, Value beta, int depth, Move &dummy_ref, int flip_budget, int cooldown){
     if(mv.type() == Flipping){
-        return star1(mv, pos, alpha, beta, depth - 1, key, dummy_ref, flip_budget, cooldown);
+        // the same flip reached through a transposition
+        Value t;
+        if(tt_->probe_chance(pos.key(), mv.from(), alpha, beta, depth - 1, t)){
+            return t;
+        }
+        t = star1(mv, pos, alpha, beta, depth - 1, dummy_ref, flip_budget, cooldown);
+        // flips right above the horizon are cheap to redo and would only
+        // push ordinary entries out of the table
+        if(!time_out_ && depth - 1 > 0){
+            TT_Flag flag = (t <= alpha) ? TT_CHANCE_UPPER : (t >= beta) ? TT_CHANCE_LOWER : TT_CHANCE_EXACT;
+            tt_->store_chance(pos.key(), mv.from(), t, depth - 1, flag);
+        }
+        return t;
     }
     else{
-        Position copy(pos);
-        copy.do_move(mv);
-        uint64_t child_key = zobrist_.update_zobrist_hash(key, mv, pos, Piece());
-        return -f4(copy, -beta, -alpha, depth - 1, child_key, dummy_ref, Move(), flip_budget, cooldown+1);
+        pos.do_move(mv);
+        tt_->prefetch(pos.key());
+        Value t = -f4<NT>(pos, -beta, -alpha, depth - 1, dummy_ref, flip_budget, cooldown+1);
+        pos.undo_move();
+        return t;
+    }
+}
+
+// Returns true once the search has to stop (stop flag or node limit). The
+// clock is the timer thread's business, see start_timer().
+bool AlphaBetaEngine::count_node_and_poll(){
+    // only this thread writes its count, so no locked increment
+    uint64_t nodes = node_count_.load(std::memory_order_relaxed) + 1;
+    node_count_.store(nodes, std::memory_order_relaxed);
+    if((nodes & 255) == 0 && node_limit_ > 0 && is_main()){
+        if(nodes_searched() >= node_limit_){
+            stop_->store(true, std::memory_order_relaxed);
+        }
     }
+    if(stop_->load(std::memory_order_relaxed)){
+        time_out_ = true;
+    }
+    return time_out_;
 }
 
-double AlphaBetaEngine::f4(Position &pos, double alpha, double beta, int depth, uint64_t key, Move &best_move_ref, const Move pv_hint, int flip_budget, int cooldown){
-    if((++node_count_ & 255) == 0){
-        auto now = std::chrono::steady_clock::now();
-        if(std::chrono::duration_cast<std::chrono::milliseconds>(now - start_time_).count() > time_limit_ms_){
-            time_out_ = true;
-            return 0;
+// Sets the stop flag _ms_ after start_time_ unless stop_timer() comes first
+void AlphaBetaEngine::start_timer(int ms){
+    timer_cancelled_ = false;
+    auto deadline = start_time_ + std::chrono::milliseconds(ms);
+    timer_thread_ = std::thread([this, deadline](){
+        std::unique_lock<std::mutex> lock(timer_mutex_);
+        if(!timer_cv_.wait_until(lock, deadline, [this]{ return timer_cancelled_; })){
+            stop_->store(true, std::memory_order_relaxed);
         }
+    });
+}
+
+void AlphaBetaEngine::stop_timer(){
+    if(!timer_thread_.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(timer_mutex_);
+        timer_cancelled_ = true;
     }
-    if(time_out_) return 0;
+    timer_cv_.notify_one();
+    timer_thread_.join();
+}
+
+void AlphaBetaEngine::stop(){
+    stop_->store(true, std::memory_order_relaxed);
+}
+
+void AlphaBetaEngine::set_hash(size_t mb){
+    stop_ponder();
+    tt_->resize(mb);
+}
+
+// Capture-only search below the horizon, so leaves are not scored in the
+// middle of an exchange. Flips are never extended.
+Value AlphaBetaEngine::qsearch(Position &pos, Value alpha, Value beta){
+    if(count_node_and_poll()) return 0;
+
+    Color winner = pos.winner();
+    if(winner != NO_COLOR){
+        return eval(pos, 0, winner);
+    }
+
+    // stand pat: the side to move may decline every capture
+    Value best = pos_score(pos, pos.due_up());
+    if(best >= beta) return best;
+    if(best > alpha) alpha = best;
+
+    Color us = pos.due_up();
+    int my_mat_idx = pos.material_index(us);
+    int opp_mat_idx = pos.material_index(~us);
+    Value material = material_table[my_mat_idx][opp_mat_idx];
+
+    MovePicker picker(pos);
+    for(Move mv = picker.next_move(); mv != Move(); mv = picker.next_move()){
+        // delta pruning: the material swing of this capture cannot reach alpha
+        PieceType victim = pos.peek_piece_at(mv.to()).type;
+        Value gain = material_table[my_mat_idx][opp_mat_idx - MaterialWeight[victim]] - material;
+        if(best + gain + QS_DELTA_MARGIN <= alpha) continue;
+
+        pos.do_move(mv);
+        Value t = -qsearch(pos, -beta, -alpha);
+        pos.undo_move();
+        if(time_out_) return 0;
+
+        if(t > best){
+            best = t;
+            if(best >= beta) return best;
+            if(best > alpha) alpha = best;
+        }
+    }
+    return best;
+}
+
+// NegaScout. NT says where the node is:
+//  - Root and PV nodes search their first move with the full window and the
+//    others with a null window, searching again those that beat it. They
+//    keep the PV and start from the previous iteration's.
+//  - NonPV nodes always have a null window, from NegaScout or from star1
+//    (see search_outcome()), so they are plain alpha-beta.
+// The root takes no TT cutoff and is never pruned, so it always has a move.
+template<NodeType NT>
+Value AlphaBetaEngine::f4(Position &pos, Value alpha, Value beta, int depth, Move &best_move_ref, int flip_budget, int cooldown){
+    constexpr bool pv_node = NT != NonPV;
+    constexpr bool root_node = NT == Root;
+    const uint64_t key = pos.key();
+    const int ply = search_ply(pos);
+    if(pv_node) pv_length_[ply] = ply;
+    if(count_node_and_poll()) return 0;
     
     Move tt_move = Move();
-    double tt_value;
-    if(tt_.probe(key, alpha, beta, depth, tt_value, tt_move)){
+    Value tt_value;
+    tt_probes_++;
+    // the root only takes the move, its window stays the aspiration window
+    Value root_alpha = alpha, root_beta = beta;
+    if(tt_->probe(key, root_node ? root_alpha : alpha, root_node ? root_beta : beta, depth, tt_value, tt_move) && !root_node){
+        tt_hits_++;
         best_move_ref = tt_move; 
         return tt_value;
     }
 
     // Terminal check
-    if(pos.winner() != NO_COLOR || depth <= 0){
-        return eval(pos, depth);
+    Color winner = pos.winner();
+    if(winner != NO_COLOR){
+        return eval(pos, depth, winner);
+    }
+    if(depth <= 0){
+        return qsearch(pos, alpha, beta);
+    }
+
+    // the futility checks stay away from win scores
+    bool prune = !root_node && std::abs(beta) < MAT_WIN_SCORE;
+    Value static_eval = -INF;
+    if(prune && ((params_.reverse_futility && depth <= REVERSE_FUTILITY_DEPTH)
+                 || (params_.futility && depth <= FUTILITY_DEPTH))){
+        static_eval = pos_score(pos, pos.due_up());
+    }
+
+    // reverse futility: so far above beta that a shallow search will not
+    // bring it back
+    if(prune && params_.reverse_futility && depth <= REVERSE_FUTILITY_DEPTH
+       && static_eval - REVERSE_FUTILITY_MARGIN * depth >= beta){
+        return static_eval;
     }
+    bool futile = prune && params_.futility && depth <= FUTILITY_DEPTH
+                  && static_eval + FUTILITY_MARGIN * depth <= alpha;
 
-    Move sort_move = (pv_hint != Move()) ? pv_hint : tt_move;
-    auto moves = get_ordered_moves(pos, sort_move);
+    // selective flips, MovePicker still hands them out when nothing can move
+    bool can_flip = !params_.flip_limits
+                    || (flip_budget > 0 && cooldown >= params_.flip_cooldown && depth >= params_.min_flip_depth);
+
+    // the previous iteration's PV goes first while we are still on it
+    Move pv_move = Move();
+    if(root_node) follow_pv_ = true;
+    if(pv_node && follow_pv_){
+        if(ply < prev_pv_length_) pv_move = prev_pv_[ply];
+        if(pv_move == Move()) follow_pv_ = false;
+    }
+    Move sort_move = (pv_move != Move()) ? pv_move : tt_move;
+    MovePicker picker(pos, sort_move, repeated_choice(pos), quiet_history(pos), can_flip);
+    Move mv = picker.next_move();
     
-    if (moves.empty()) return -(AB_WIN_SCORE + depth);
+    if (mv == Move()) return -(AB_WIN_SCORE + depth);
 
-    double m = -INF;
-    double n = beta;
-    Move best_move_this_node = moves[0].mv;
+    Value m = -INF;
+    Value n = beta;
+    Move best_move_this_node = mv;
     best_move_ref = best_move_this_node; 
 
     Move dummy_ref;
 
-    // MoveList<Moving>non_flip_moves(pos);
-    // bool can_flip = (non_flip_moves.size() == 0 || (flip_budget > 0 && cooldown >= FLIP_COOLDOWN_REQ && depth >= MIN_DEPTH_FOR_FLIP));
+    int move_count = 0;
+    for(; mv != Move(); mv = picker.next_move()){
+        bool quiet = mv.type() == Moving && pos.peek_piece_at(mv.to()).type == NO_PIECE;
+        move_count++;
+        if(pv_node && mv != pv_move) follow_pv_ = false;
 
-    for(int i = 0; i < moves.size(); i++){
+        // futility: a quiet move cannot win back the material we are short of
+        if(futile && quiet && move_count > 1) continue;
 
-        double upper_bound = (moves[i].mv.type() == Flipping) ? beta : n;
-        double t = try_move(pos, moves[i].mv, std::max(alpha, m), upper_bound, depth, key, dummy_ref, flip_budget, cooldown);
-        
-        if(time_out_) return 0;
-
-        if(t > m){
-            if(n == beta || depth < 3 || t >= beta || moves[i].mv.type() == Flipping){
+        Value t;
+        bool pv_child = false;// whether pv_table_[ply + 1] is the line of mv
+        if(!pv_node){
+            if(params_.lmr && quiet && depth >= LMR_MIN_DEPTH && move_count > LMR_MIN_MOVES){
+                // late move reduction, searched again at full depth if it fails high
+                int reduction = (move_count > 2 * LMR_MIN_MOVES && depth > LMR_MIN_DEPTH) ? 2 : 1;
+                t = try_move<NonPV>(pos, mv, std::max(alpha, m), beta, depth - reduction, dummy_ref, flip_budget, cooldown);
+                if(!time_out_ && t > std::max(alpha, m)){
+                    t = try_move<NonPV>(pos, mv, std::max(alpha, m), beta, depth, dummy_ref, flip_budget, cooldown);
+                }
+            }
+            else{
+                t = try_move<NonPV>(pos, mv, std::max(alpha, m), beta, depth, dummy_ref, flip_budget, cooldown);
+            }
+            if(time_out_) return 0;
+            if(t > m){
                 m = t;
+                best_move_this_node = mv;
+                best_move_ref = best_move_this_node; 
+            }
+        }
+        else{
+            if(move_count == 1 || mv.type() == Flipping){
+                t = try_move<PV>(pos, mv, std::max(alpha, m), beta, depth, dummy_ref, flip_budget, cooldown);
+                pv_child = true;
             }
             else{
-                // Re-search
-                m = try_move(pos, moves[i].mv, t, beta, depth, key, dummy_ref, flip_budget, cooldown);
-                if(time_out_) return 0;
+                t = try_move<NonPV>(pos, mv, std::max(alpha, m), n, depth, dummy_ref, flip_budget, cooldown);
+            }
+            if(time_out_) return 0;
+
+            if(t > m){
+                if(pv_child || depth < 3 || t >= beta){
+                    m = t;
+                }
+                else{
+                    // Re-search
+                    m = try_move<PV>(pos, mv, t, beta, depth, dummy_ref, flip_budget, cooldown);
+                    pv_child = true;
+                    if(time_out_) return 0;
+                }
+                best_move_this_node = mv;
+                best_move_ref = best_move_this_node; 
+                update_pv(ply, mv, pv_child);
             }
-            best_move_this_node = moves[i].mv;
-            best_move_ref = best_move_this_node; 
         }
         if(m >= beta){
-            tt_.store(key, m, depth, TT_BETA, best_move_this_node);
+            tt_->store(key, m, depth, TT_BETA, best_move_this_node);
+            cutoffs_++;
+            if(move_count == 1) first_move_cutoffs_++;
+            if(quiet) update_quiet_history(pos, mv, depth);
 
-            if (moves[i].mv.type() != Flipping) {
+            if (mv.type() != Flipping) {
                 // Weight = 2^depth. Clamp depth to avoid overflow
                 int weight = 1 << std::min(depth, 14);
-                history_table_[moves[i].mv.from()][moves[i].mv.to()] += weight;
+                history_table_[mv.from()][mv.to()] += weight;
                 
                 // Aging check: Prevent overflow (e.g. if > 1M)
-                if(history_table_[moves[i].mv.from()][moves[i].mv.to()] > 1000000){
+                if(history_table_[mv.from()][mv.to()] > 1000000){
                     age_history_table();
                 }
             }
 
             return m; // Beta cutoff
         }
-        n = std::max(alpha, m) + 0.001;
+        if(pv_node) n = std::max(alpha, m) + 1;
     }
 
     if(m > alpha){
-        tt_.store(key, m, depth, TT_EXACT, best_move_this_node);
+        tt_->store(key, m, depth, TT_EXACT, best_move_this_node);
         if(best_move_this_node.type() != Flipping){
             int weight = 1 << std::min(depth, 14);
             history_table_[best_move_this_node.from()][best_move_this_node.to()] += weight;
         }
     }
     else{
-        tt_.store(key, m, depth, TT_ALPHA, best_move_this_node);
+        tt_->store(key, m, depth, TT_ALPHA, best_move_this_node);
     }
 
     return m;
 }
 
+// star1 windows come from the outcome probabilities rather than from
+// NegaScout, so the node type follows the window
+Value AlphaBetaEngine::search_outcome(Position &pos, Value alpha, Value beta, int depth, Move &best_move_ref, int flip_budget, int cooldown){
+    if(beta - alpha > 1) return f4<PV>(pos, alpha, beta, depth, best_move_ref, flip_budget, cooldown);
+    return f4<NonPV>(pos, alpha, beta, depth, best_move_ref, flip_budget, cooldown);
+}
+
+// One iteration at the root, in a window of ASPIRATION_WINDOW around the
+// score of the previous one. The side that fails is widened, twice as far
+// each time, until the score falls inside. Windows never reach past
+// V_MIN / V_MAX, what lies beyond is a win or loss, so a window that would
+// goes to -INF / INF instead.
+Value AlphaBetaEngine::aspiration_search(Position &pos, int depth, Value prev_score, Move &best_move_ref){
+    Value delta = ASPIRATION_WINDOW;
+    Value alpha = -INF, beta = INF;
+    // the move of the last window that failed high, if the search does
+    Move fail_high_move = Move();
+    if(depth > 1 && std::abs(prev_score) < MAT_WIN_SCORE){
+        alpha = prev_score - delta;
+        beta = prev_score + delta;
+    }
+
+    while(true){
+        if(alpha <= V_MIN) alpha = -INF;
+        if(beta >= V_MAX) beta = INF;
+
+        // the root may always flip
+        Move best_move = Move();
+        Value score = f4<Root>(pos, alpha, beta, depth, best_move, params_.flip_budget, params_.flip_cooldown);
+        if(time_out_){
+            // score is no score, but a move that failed high before the
+            // time ran out is still good to play
+            if(fail_high_move != Move()) best_move_ref = fail_high_move;
+            return score;
+        }
+
+        if(score <= alpha && alpha > -INF){
+            beta = (alpha + beta) / 2;
+            alpha = score - delta;
+        }
+        else if(score >= beta && beta < INF){
+            fail_high_move = best_move;
+            beta = score + delta;
+        }
+        else{
+            best_move_ref = best_move;
+            return score;
+        }
+        aspiration_researches_++;
+        delta *= 2;
+    }
+}
+
+// _mv_ is the new best move at _ply_, followed by the line its child left
+// if the child was a PV node (_pv_child_)
+void AlphaBetaEngine::update_pv(int ply, Move mv, bool pv_child){
+    pv_table_[ply][ply] = mv;
+    pv_length_[ply] = ply + 1;
+    // a flip ends the line, what follows depends on the piece
+    if(!pv_child || mv.type() == Flipping || ply + 1 >= MAX_PLY) return;
+    for(int i = ply + 1; i < pv_length_[ply + 1]; i++){
+        pv_table_[ply][i] = pv_table_[ply + 1][i];
+    }
+    pv_length_[ply] = std::max(pv_length_[ply + 1], ply + 1);
+}
+
+// depth, score, nodes, nps and PV of a finished iteration, on stderr
+void AlphaBetaEngine::report_iteration(int depth, Value score) const{
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::steady_clock::now() - start_time_).count();
+    uint64_t nodes = nodes_searched();
+    debug << "depth " << depth << " score " << double(score) / VALUE_SCALE << " nodes " << nodes
+          << " nps " << nodes * 1000 / std::max<long long>(ms, 1)
+          << " researches " << aspiration_researches_ << " pv";
+    for(int i = 0; i < pv_length_[0]; i++){
+        const Move &mv = pv_table_[0][i];
+        if(mv.type() == Flipping) debug << " ?" << mv.from();
+        else debug << " " << mv.from() << mv.to();
+    }
+    debug << "\n";
+}
+
 void AlphaBetaEngine::init_game(){
     ply_count_ = 0;
     no_eat_flip = 0;
     prev_total_count = SQUARE_NB;
-    std::memset(history_table_, 0, sizeof(history_table_));
+    clear_quiet_history();
     for(int pt = General; pt <= Soldier; pt++){
         unrevealed_count[0][pt] = init_counts[pt];
         unrevealed_count[1][pt] = init_counts[pt];
@@ -260,48 +844,64 @@ void AlphaBetaEngine::age_history_table() {
             history_table_[i][j] >>= 1; 
         }
     }
+    for (auto &side : piece_history_) {
+        for (auto &pt : side) {
+            for (int &h : pt) {
+                h >>= 1;
+            }
+        }
+    }
 }
-std::vector<AlphaBetaEngine::ScoredMove> AlphaBetaEngine::get_ordered_moves(const Position &pos, Move tt_move) {
-    MoveList<> raw_moves(pos);
-    std::vector<ScoredMove> moves;
-    moves.reserve(raw_moves.size());
 
-    Move prev_choice = check_previous_choice(zobrist_.compute_zobrist_hash(pos));
-
-    for(Move mv : raw_moves){
-        if(mv == prev_choice && pos_score(pos, pos.due_up()) > 0){
-            continue;// avoid cycles
-        }
+void AlphaBetaEngine::clear_quiet_history(){
+    std::memset(history_table_, 0, sizeof(history_table_));
+    std::memset(piece_history_, 0, sizeof(piece_history_));
+    std::fill(&countermoves_[0][0], &countermoves_[0][0] + SQUARE_NB * SQUARE_NB, Move());
+    std::fill(&killers_[0][0], &killers_[0][0] + MAX_PLY * 2, Move());
+}
 
-        int score = 0;
+int AlphaBetaEngine::search_ply(const Position &pos) const{
+    return std::max(0, std::min(pos.game_ply() - root_ply_, MAX_PLY - 1));
+}
 
-        if(mv == tt_move){
-            score = SCORE_TT_MOVE; // Highest priority
-        } 
-        else if(mv.type() == Flipping){
-            score = SCORE_FLIP_BASE + flip_score; // Higher than History
-        }
-        else{
-            PieceType from = pos.peek_piece_at(mv.from()).type;
-            PieceType to = pos.peek_piece_at(mv.to()).type;
+QuietHistory AlphaBetaEngine::quiet_history(const Position &pos){
+    QuietHistory quiet;
+    quiet.butterfly = history_table_;
+    quiet.piece_to = piece_history_[pos.due_up()];
+    int ply = search_ply(pos);
+    quiet.killers[0] = killers_[ply][0];
+    quiet.killers[1] = killers_[ply][1];
+    Move last = pos.last_move();
+    quiet.countermove = (last != Move()) ? countermoves_[last.from()][last.to()] : Move();
+    return quiet;
+}
 
-            if(to != NO_PIECE){
-                // Eating: Higher than Flips and History
-                score = SCORE_CAPTURE_BASE + yummy_table[from][to];
-            } 
-            else{
-                score = history_table_[mv.from()][mv.to()];
-            }
-        }
-        moves.push_back({mv, score});
+// A quiet move _mv_ cut off in _pos_ (not played yet)
+void AlphaBetaEngine::update_quiet_history(const Position &pos, Move mv, int depth){
+    int ply = search_ply(pos);
+    if(killers_[ply][0] != mv){
+        killers_[ply][1] = killers_[ply][0];
+        killers_[ply][0] = mv;
+    }
+    Move last = pos.last_move();
+    if(last != Move()){
+        countermoves_[last.from()][last.to()] = mv;
+    }
+    // same weight as history_table_, which f4 updates itself
+    int &h = piece_history_[pos.due_up()][pos.peek_piece_at(mv.from()).type][mv.to()];
+    h += 1 << std::min(depth, 14);
+    if(h > 1000000){
+        age_history_table();
     }
-
-    // Sort descending
-    std::sort(moves.begin(), moves.end(), [](const ScoredMove& a, const ScoredMove& b) {
-        return a.score > b.score;
-    });
-
-    return moves;
+}
+// A move played from this very position earlier in the game, which we do
+// not repeat while ahead to avoid cycles.
+Move AlphaBetaEngine::repeated_choice(const Position &pos){
+    Move prev_choice = check_previous_choice(pos.key());
+    if(prev_choice != Move() && pos_score(pos, pos.due_up()) > 0){
+        return prev_choice;
+    }
+    return Move();
 }
 
 double AlphaBetaEngine::estimatePlyTime(const Position& pos) {
@@ -327,10 +927,22 @@ Move AlphaBetaEngine::check_previous_choice(uint64_t key){
     return Move();
 }
 
-Move AlphaBetaEngine::search(Position &pos){
+Move AlphaBetaEngine::search(Position &pos, const SearchLimits &limits){
+    stop_ponder();
     start_time_ = std::chrono::steady_clock::now();
     time_out_ = false;
-    node_count_ = 0;
+    node_count_.store(0, std::memory_order_relaxed);
+    chance_nodes_ = 0;
+    chance_outcomes_searched_ = 0;
+    sampled_chance_nodes_ = 0;
+    sample_error_sum_ = 0;
+    aspiration_researches_ = 0;
+    tt_probes_ = 0;
+    tt_hits_ = 0;
+    cutoffs_ = 0;
+    first_move_cutoffs_ = 0;
+    stop_->store(false, std::memory_order_relaxed);
+    tt_->new_search();
     
     // handle new game start
     if(pos.count(Hidden) == SQUARE_NB){
@@ -367,26 +979,97 @@ Move AlphaBetaEngine::search(Position &pos){
         }
     }
 
-    Move best_move_root = Move();
-    uint64_t key = zobrist_.compute_zobrist_hash(pos);
+    sync_bag(pos);
+    uint64_t key = pos.key();
 
     Move tt_move = Move();
-    double tt_val;
-    double dummy_alpha = -INF, dummy_beta = INF;
-    tt_.probe(key, dummy_alpha, dummy_beta, 0, tt_val, tt_move);
-    auto moves = get_ordered_moves(pos, best_move_root);
-    if(best_move_root == Move()){
-        best_move_root = moves[0].mv;
+    Value tt_val;
+    Value dummy_alpha = -INF, dummy_beta = INF;
+    tt_->probe(key, dummy_alpha, dummy_beta, 0, tt_val, tt_move);
+
+    // nothing to think about
+    MoveList<> legal(pos);
+    if(legal.size() == 1){
+        store_choice(key, legal[0]);
+        return legal[0];
+    }
+
+    manage_time_ = false;
+    if(limits.movetime_ms > 0){
+        time_limit_ms_ = limits.movetime_ms;
+    }
+    else if(limits.depth > 0 || limits.nodes > 0){
+        time_limit_ms_ = std::numeric_limits<int>::max();
     }
-    else if(moves.empty()){
+    else if(pos.time_left() > 0){
+        double optimum = estimatePlyTime(pos);
+        double maximum = std::min(optimum * TM_MAX_FACTOR, pos.time_left() * TM_MAX_SHARE);
+        time_manager_.start(start_time_, optimum, maximum);
+        time_limit_ms_ = time_manager_.maximum_ms();
+        manage_time_ = true;
+    }
+    else{
+        time_limit_ms_ = DEFAULT_MOVE_TIME_MS;
+    }
+    int max_depth = (limits.depth > 0) ? std::min(limits.depth, MAX_SEARCH_DEPTH) : MAX_SEARCH_DEPTH;
+    node_limit_ = limits.nodes;
+
+    // the opponent played the reply we pondered on: its subtree is in the
+    // TT already, start from our answer there. Otherwise only the TT helps.
+    seeded_pv_ = false;
+    if(ponder_hit(pos) && ponder_pv_length_ > 1){
+        std::copy(ponder_pv_ + 1, ponder_pv_ + ponder_pv_length_, prev_pv_);
+        prev_pv_length_ = ponder_pv_length_ - 1;
+        seeded_pv_ = true;
+        debug << "ponder hit\n";
+    }
+    ponder_pv_length_ = 0;
+
+    if(time_limit_ms_ != std::numeric_limits<int>::max()) start_timer(time_limit_ms_);
+    start_helpers(pos, max_depth);
+    Move best_move_root = iterative_deepening(pos, max_depth);
+    stop_helpers();
+    stop_timer();
+
+    // a racy TT read from another thread may hand us a move that does not
+    // exist here, never play it
+    if(legal.size() > 0 && std::find(legal.begin(), legal.end(), best_move_root) == legal.end()){
+        error << "search: [Warn] best move is not legal, falling back\n";
+        best_move_root = MovePicker(pos, Move(), repeated_choice(pos), quiet_history(pos)).next_move();
+    }
+
+    store_choice(key, best_move_root);
+    return best_move_root;
+}
+
+Move AlphaBetaEngine::iterative_deepening(Position &pos, int max_depth){
+    root_ply_ = pos.game_ply();
+    Move best_move_root = MovePicker(pos, Move(), repeated_choice(pos), quiet_history(pos)).next_move();
+    if(best_move_root == Move()){
         error << "NO AVAILABLE MOVE\n";
+        return Move();
     }
 
-    for(int depth = 1; depth <= 50; depth++){
-        
+    // killers are about plies of this search only
+    std::fill(&killers_[0][0], &killers_[0][0] + MAX_PLY * 2, Move());
+    if(seeded_pv_){
+        best_move_root = prev_pv_[0];
+        seeded_pv_ = false;
+    }
+    else{
+        prev_pv_[0] = best_move_root;
+        prev_pv_length_ = 1;
+    }
+    Value score = 0;
+    for(int depth = 1; depth <= max_depth; depth++){
+        root_depth_ = depth;
+        if(!is_main()){
+            int i = (thread_id_ - 1) % 20;
+            if(((depth + SKIP_PHASE[i]) / SKIP_SIZE[i]) % 2) continue;
+        }
+
         Move best_move_this_iter = Move();
-        
-        f4(pos, -INF, INF, depth, key, best_move_this_iter, best_move_root);
+        score = aspiration_search(pos, depth, score, best_move_this_iter);
         
         if(time_out_){
             if(best_move_this_iter != Move()){
@@ -397,27 +1080,28 @@ Move AlphaBetaEngine::search(Position &pos){
         }
         
         best_move_root = best_move_this_iter;
+        // a TT hit at the root leaves no line behind
+        if(pv_length_[0] == 0){
+            pv_table_[0][0] = best_move_root;
+            pv_length_[0] = 1;
+        }
+        std::copy(pv_table_[0], pv_table_[0] + pv_length_[0], prev_pv_);
+        prev_pv_length_ = pv_length_[0];
+        if(is_main()){
+            report_iteration(depth, score);
+            // better to stop now than to drop most of an unfinished iteration
+            if(manage_time_ && !time_manager_.next_iteration(best_move_root, score, nodes_searched())) break;
+        }
         // log_position(depth, best_move_root, false, false);
     }
-    store_choice(key, best_move_root);
     return best_move_root;
 }
 
-int AlphaBetaEngine::get_material_index(const Position &pos, Color c) const{
-    return pos.count(c, Soldier) +
-           pos.count(c, Cannon) * 6 +
-           pos.count(c, Horse) * 18 +
-           pos.count(c, Chariot) * 54 +
-           pos.count(c, Elephant) * 162 +
-           pos.count(c, Advisor) * 486 +
-           pos.count(c, General) * 1458;
-}
-
-double AlphaBetaEngine::pos_score(const Position &pos, const Color cur_color){
-    int my_mat_idx = get_material_index(pos, cur_color);
-    int opp_mat_idx = get_material_index(pos, Color(cur_color ^ 1));
+Value AlphaBetaEngine::pos_score(const Position &pos, const Color cur_color){
+    int my_mat_idx = pos.material_index(cur_color);
+    int opp_mat_idx = pos.material_index(Color(cur_color ^ 1));
 
-    double score = material_table[my_mat_idx][opp_mat_idx];
+    Value score = material_table[my_mat_idx][opp_mat_idx];
 
     Color opp_color = Color(cur_color ^ 1);
     Board my_board = pos.pieces(cur_color);
@@ -0,0 +1,161 @@
+#include "../h/move_picker.h"
+#include "../h/alphabeta.h"
+#include "../h/see.h"
+
+MovePicker::MovePicker(const Position &pos, Move tt_move, Move skip, const QuietHistory &quiet, bool flips)
+  : pos_(pos), quiet_(quiet), refutations_{}, refutation_idx_(0), tt_move_(tt_move), skip_(skip), stage_(TT_STAGE),
+    captures_only_(false), flips_(flips), can_move_(false),
+    cur_(moves_), end_(moves_), begin_quiets_(moves_), end_quiets_(moves_), end_bad_captures_(moves_)
+{
+    if(tt_move_ == skip_ || !is_legal(pos_, tt_move_) || (!flips_ && tt_move_.type() == Flipping)){
+        tt_move_ = Move();
+        stage_ = CAPTURE_INIT;
+    }
+
+    // killers and countermove come from other positions, keep the quiet
+    // moves that are legal here and not handed out already
+    Move candidates[3] = { quiet_.killers[0], quiet_.killers[1], quiet_.countermove };
+    int n = 0;
+    for(Move mv : candidates){
+        if(mv == tt_move_ || mv == skip_ || mv.type() != Moving) continue;
+        if(std::find(refutations_, refutations_ + n, mv) != refutations_ + n) continue;
+        if(!is_legal(pos_, mv) || pos_.peek_piece_at(mv.to()).type != NO_PIECE) continue;
+        refutations_[n++] = mv;
+    }
+}
+
+MovePicker::MovePicker(const Position &pos)
+  : pos_(pos), quiet_(), refutations_{}, refutation_idx_(0), tt_move_(Move()), skip_(Move()), stage_(CAPTURE_INIT),
+    captures_only_(true), flips_(false), can_move_(false),
+    cur_(moves_), end_(moves_), begin_quiets_(moves_), end_quiets_(moves_), end_bad_captures_(moves_)
+{}
+
+bool MovePicker::is_legal(const Position &pos, Move mv){
+    if(mv == Move()) return false;
+    if(mv.type() == Flipping){
+        return pos.peek_piece_at(mv.from()).type == Hidden;
+    }
+    if(mv.type() != Moving) return false;
+
+    Piece src = pos.peek_piece_at(mv.from());
+    Piece dst = pos.peek_piece_at(mv.to());
+    if(src.side != pos.due_up() || src.type > Soldier) return false;
+    if(!(attacks_bb(src.type, mv.from(), pos.pieces()) & mv.to())) return false;
+    // same targets as generate(): an empty square or a subordinate
+    return dst.type == NO_PIECE || (pos.subordinates(src.side, src.type) & mv.to());
+}
+
+Move MovePicker::select_best(){
+    while(cur_ < end_){
+        ScoredMove *best = cur_;
+        for(ScoredMove *it = cur_ + 1; it < end_; it++){
+            if(it->score > best->score) best = it;
+        }
+        std::swap(*best, *cur_);
+        Move mv = (cur_++)->mv;
+        if(mv != tt_move_ && mv != skip_
+           && mv != refutations_[0] && mv != refutations_[1] && mv != refutations_[2]) return mv;
+    }
+    return Move();
+}
+
+Move MovePicker::next_move(){
+    Move buf[MAX_MOVES];
+    Move mv;
+    switch(stage_){
+    case TT_STAGE:
+        stage_ = CAPTURE_INIT;
+        return tt_move_;
+
+    case CAPTURE_INIT:{
+        // captures to the front, quiet moves wait behind them until QUIET_INIT
+        Move *last = generate<Moving, Mystery>(pos_, ALL_PIECES, buf);
+        ScoredMove *captures = moves_, *quiets = moves_ + (last - buf);
+        for(Move *it = buf; it < last; it++){
+            Piece dst = pos_.peek_piece_at(it->to());
+            if(dst.type != NO_PIECE){
+                PieceType src = pos_.peek_piece_at(it->from()).type;
+                *captures++ = { *it, yummy_table[src][dst.type] };
+            }
+            else{
+                *--quiets = { *it, 0 };
+            }
+        }
+        cur_ = moves_;
+        end_ = captures;
+        begin_quiets_ = captures;
+        end_quiets_ = moves_ + (last - buf);
+        // the repeated choice is never handed out, so it does not count
+        can_move_ = std::find_if(buf, last, [this](Move m){ return m != skip_; }) != last;
+        stage_ = CAPTURES;
+    }
+        [[fallthrough]];
+
+    case CAPTURES:
+        while((mv = select_best()) != Move()){
+            if(see(pos_, mv) >= 0) return mv;
+            // cur_ has moved past it, so this never overwrites an unpicked capture
+            *end_bad_captures_++ = { mv, 0 };
+        }
+        if(captures_only_){
+            stage_ = DONE;
+            return Move();
+        }
+        stage_ = REFUTATIONS;
+        [[fallthrough]];
+
+    case REFUTATIONS:
+        while(refutation_idx_ < 3){
+            if((mv = refutations_[refutation_idx_++]) != Move()) return mv;
+        }
+        stage_ = FLIP_INIT;
+        [[fallthrough]];
+
+    case FLIP_INIT:{
+        // flips go behind the quiet moves, they are all worth the same
+        cur_ = end_quiets_;
+        end_ = end_quiets_;
+        Move *last = (flips_ || !can_move_) ? generate<Flipping, Mystery>(pos_, ALL_PIECES, buf) : buf;
+        for(Move *it = buf; it < last; it++){
+            *end_++ = { *it, flip_score };
+        }
+        stage_ = FLIPS;
+    }
+        [[fallthrough]];
+
+    case FLIPS:
+        while(cur_ < end_){
+            mv = (cur_++)->mv;
+            if(mv != tt_move_ && mv != skip_) return mv;
+        }
+        stage_ = QUIET_INIT;
+        [[fallthrough]];
+
+    case QUIET_INIT:{
+        cur_ = begin_quiets_;
+        end_ = end_quiets_;
+        for(ScoredMove *it = cur_; it < end_; it++){
+            PieceType pt = pos_.peek_piece_at(it->mv.from()).type;
+            it->score = quiet_.butterfly[it->mv.from()][it->mv.to()] + quiet_.piece_to[pt][it->mv.to()];
+        }
+        stage_ = QUIETS;
+    }
+        [[fallthrough]];
+
+    case QUIETS:
+        if((mv = select_best()) != Move()) return mv;
+        cur_ = moves_;
+        stage_ = BAD_CAPTURES;
+        [[fallthrough]];
+
+    case BAD_CAPTURES:
+        // already in yummy_table order
+        if(cur_ < end_bad_captures_) return (cur_++)->mv;
+        stage_ = DONE;
+        [[fallthrough]];
+
+    case DONE:
+        return Move();
+    }
+    return Move();
+}
@@ -0,0 +1,54 @@
+#include "../h/see.h"
+#include "../h/alphabeta.h"
+#include "../../lib/marisa.h"
+
+// Cheapest first, by Piece_Value
+static const PieceType SEE_ORDER[MOVABLE_PIECE_TYPE_NB] = {
+    Soldier, Horse, Chariot, Cannon, Elephant, Advisor, General
+};
+
+// Finds the least valuable piece of _side_ that can capture a _target_ on _sq_.
+// Adjacent pieces use PseudoAttacks, cannons jump over exactly one screen.
+static Square least_valuable_attacker(const Position &pos, Color side, Square sq, PieceType target, Board occupied, PieceType &attacker){
+    Board adjacent = PseudoAttacks[sq] & occupied;
+    for(PieceType pt : SEE_ORDER){
+        if(!(pt > target)) continue;
+        Board bb = pos.pieces(side, pt) & occupied;
+        bb &= (pt == Cannon) ? cannonMagics[sq].attacks_bb(occupied) : adjacent;
+        if(bb){
+            attacker = pt;
+            return Square(__builtin_ctz(bb));
+        }
+    }
+    return SQ_NONE;
+}
+
+int see(const Position &pos, Move mv){
+    Square to = mv.to();
+    Square capturer_sq = mv.from();
+    PieceType capturer = pos.peek_piece_at(capturer_sq).type;
+    Color side = ~pos.due_up(); // who may recapture next
+    Board occupied = pos.pieces();
+
+    // gain[d]: balance for the side making the d-th capture, assuming the
+    // piece it lands with is taken back (speculative until proven)
+    int gain[SQUARE_NB];
+    int d = 0;
+    gain[0] = Piece_Value[pos.peek_piece_at(to).type];
+    while(true){
+        d++;
+        gain[d] = Piece_Value[capturer] - gain[d - 1];
+        if(std::max(-gain[d - 1], gain[d]) < 0) break; // cannot change the result
+
+        occupied ^= square_bb(capturer_sq);
+        PieceType next;
+        capturer_sq = least_valuable_attacker(pos, side, to, capturer, occupied, next);
+        if(capturer_sq == SQ_NONE) break;
+        capturer = next;
+        side = ~side;
+    }
+    while(--d){
+        gain[d - 1] = -std::max(-gain[d - 1], gain[d]);
+    }
+    return gain[0];
+}
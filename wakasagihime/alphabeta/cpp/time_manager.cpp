@@ -0,0 +1,66 @@
+#include "../h/time_manager.h"
+#include "../h/alphabeta.h"
+
+void TimeManager::start(std::chrono::steady_clock::time_point start, double optimum_ms, double maximum_ms){
+    start_ = start;
+    optimum_ms_ = optimum_ms;
+    maximum_ms_ = std::max(optimum_ms, maximum_ms);
+    last_end_ms_ = 0;
+    last_iteration_ms_ = 0;
+    last_nodes_ = 0;
+    last_iteration_nodes_ = 0;
+    last_ebf_ = 0;
+    last_best_ = Move();
+    last_score_ = 0;
+    iterations_ = 0;
+    stable_iterations_ = 0;
+    instability_ = 1.0;
+}
+
+double TimeManager::elapsed_ms() const{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_).count();
+}
+
+bool TimeManager::next_iteration(Move best, Value score, uint64_t nodes){
+    double now = elapsed_ms();
+    double iteration_ms = now - last_end_ms_;
+    uint64_t iteration_nodes = nodes - last_nodes_;
+
+    double scale = 1.0;
+    if(iterations_ > 0){
+        if(best != last_best_){
+            stable_iterations_ = 0;
+            instability_ = std::min(instability_ * TM_BEST_MOVE_CHANGE, TM_MAX_INSTABILITY);
+        }
+        else{
+            stable_iterations_++;
+            instability_ = std::max(1.0, instability_ * TM_INSTABILITY_DECAY);
+        }
+        scale *= instability_;
+        if(score < last_score_ - TM_SCORE_DROP) scale *= TM_SCORE_DROP_EXTENSION;
+    }
+    if(stable_iterations_ >= TM_OBVIOUS_ITERATIONS) scale *= TM_OBVIOUS_SHARE;
+
+    // the next iteration costs about this one times the branching factor.
+    // Flip plies branch much more than the others, so take the larger of
+    // the last two factors.
+    double ebf = TM_DEFAULT_EBF;
+    if(last_iteration_nodes_ > 0 && iteration_nodes > 0){
+        ebf = std::max(1.0, std::min(double(iteration_nodes) / last_iteration_nodes_, TM_MAX_EBF));
+    }
+    double predicted_end = now + iteration_ms * std::max(ebf, last_ebf_);
+    last_ebf_ = ebf;
+
+    last_end_ms_ = now;
+    last_iteration_ms_ = iteration_ms;
+    last_nodes_ = nodes;
+    last_iteration_nodes_ = iteration_nodes;
+    last_best_ = best;
+    last_score_ = score;
+    iterations_++;
+
+    // running over the target a little is fine, running into the hard
+    // limit throws the whole iteration away
+    double target = optimum_ms_ * scale;
+    return now < target && predicted_end <= std::min(target * TM_OVERSHOOT, maximum_ms_);
+}
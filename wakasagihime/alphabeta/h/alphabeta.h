@@ -9,16 +9,22 @@
 #include "../../lib/helper.h"
 #include "../../lib/chess.h"
 #include "../../tt/h/transposition_table.h"
-#include "../../tt/h/zobrist.h"
 #include "../../lib/chess.h"
 #include "../../lib/movegen.h"
 #include "../../lib/helper.h"
+#include "move_picker.h"
+#include "time_manager.h"
 #include <algorithm>
 #include <fstream>
 #include <chrono>
 #include <unordered_map>
 #include <vector>
 #include <cstring>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 const int Piece_Value[] = {
     30, // General
@@ -56,9 +62,9 @@ const int yummy_table[7][8] = {
 };
 const int flip_score = 10;
 
-const double INF = 1e6;
-const int AB_WIN_SCORE = 300;
-const int MAT_WIN_SCORE = 150;
+const Value INF = 1 << 24;// beyond any score
+const Value AB_WIN_SCORE = 300 * VALUE_SCALE;
+const Value MAT_WIN_SCORE = 150 * VALUE_SCALE;
 const double WIN = 1.0;
 const double LOSS = 0.0;
 constexpr int MAT_SIZE = 2916;
@@ -66,67 +72,200 @@ const double SCALING_FACTOR = 200.0;
 const int MAX_NO_EAT_FLIP = 20;
 const double MAX_TIME_MS = 15000.0;
 const double MIN_TIME_MS = 100.0;
+const int DEFAULT_MOVE_TIME_MS = 5000;
+
+// Time manager, see TimeManager
+const double TM_MAX_FACTOR = 3.0;          // hard limit: this many optimum times,
+const double TM_MAX_SHARE = 0.2;           // but never more of the clock than this
+const double TM_BEST_MOVE_CHANGE = 1.5;    // instability grows by this on a new best move
+const double TM_INSTABILITY_DECAY = 0.8;   // and shrinks by this otherwise
+const double TM_MAX_INSTABILITY = 2.5;
+const Value TM_SCORE_DROP = 5 * VALUE_SCALE; // a fall this large (a chariot) buys more time
+const double TM_SCORE_DROP_EXTENSION = 1.5;
+const int TM_OBVIOUS_ITERATIONS = 6;       // same best move this long: an obvious move
+const double TM_OBVIOUS_SHARE = 0.5;
+const double TM_OVERSHOOT = 1.5;           // an iteration may end this far past the target
+const double TM_DEFAULT_EBF = 6.0;
+const double TM_MAX_EBF = 50.0;
 
 const int EXPECTED_PLYS = 80;
 const int EXPECTED_PLY_LONG = 120;
-const double ASPIRATION_WINDOW = 25.0;
+const Value ASPIRATION_WINDOW = 5 * VALUE_SCALE; // first half-width, a chariot
 
-const double EPSILON = 1e-5;
-const int SCORE_TT_MOVE = 100000000;
-const int SCORE_CAPTURE_BASE = 50000000;
-const int SCORE_FLIP_BASE = 40000000;
 const int SCORE_HISTORY_MAX = 10000000;
 
-const double V_MAX = 320.0;
-const double V_MIN = -320.0;
+// Quiescence search: skip a capture if even winning its victim outright
+// leaves the stand-pat score this far below alpha
+const Value QS_DELTA_MARGIN = 5 * VALUE_SCALE;
+
+// Pruning margins, a soldier is VALUE_SCALE and a general 30 of those
+const Value FUTILITY_MARGIN = 5 * VALUE_SCALE;         // per ply, quiet moves that cannot reach alpha
+const Value REVERSE_FUTILITY_MARGIN = 5 * VALUE_SCALE; // per ply, static eval this far above beta
+const int FUTILITY_DEPTH = 2;
+const int REVERSE_FUTILITY_DEPTH = 3;
+const int LMR_MIN_DEPTH = 3;
+const int LMR_MIN_MOVES = 3; // moves searched at full depth before reducing
+
+const Value V_MAX = 320 * VALUE_SCALE;
+const Value V_MIN = -320 * VALUE_SCALE;
 
-const int MAX_FLIP_BUDGET = 3;   // Max 2 flips per path
+const int MAX_SEARCH_DEPTH = 32;
+// every ply of a search can be undone: its depth, then at most one capture
+// per piece but the last in qsearch
+static_assert(MAX_SEARCH_DEPTH + SQUARE_NB - 1 <= HISTORY_CAPACITY, "Position history too short for a search");
+const int MAX_PLY = 128;
+const int MAX_THREADS = 64;
+
+const int MAX_FLIP_BUDGET = 3;   // Max 3 flips per path
 const int FLIP_COOLDOWN_REQ = 1; // Separate flips by 1 move
 const int MIN_DEPTH_FOR_FLIP = 0; // Stop flipping near leaf
 
+// Root: f4 at the root, PV: searched with a full window, NonPV: with a null window
+enum NodeType { NonPV, PV, Root };
+
+struct SearchLimits{
+    int depth = 0;       // 0: iterate until the clock runs out
+    int movetime_ms = 0; // 0: budget from the clock in the position
+    uint64_t nodes = 0;  // 0: no node limit
+};
+
+// Pruning switches, so each technique can be measured on its own
+struct SearchParams{
+    bool lmr = true;              // late move reductions of quiet moves
+    bool futility = true;         // skip quiet moves near the leaves when far below alpha
+    bool reverse_futility = true; // cut nodes near the leaves when far above beta
+    bool star2 = true;            // probe every flip outcome before the Star1 pass
+    // selective flips: at most flip_budget chance nodes on a path, at least
+    // flip_cooldown plies apart, none below min_flip_depth
+    bool flip_limits = true;
+    int flip_budget = MAX_FLIP_BUDGET;
+    int flip_cooldown = FLIP_COOLDOWN_REQ;
+    int min_flip_depth = MIN_DEPTH_FOR_FLIP;
+    // sparse sampling: chance nodes at least sparse_min_ply from the root search
+    // only sparse_samples outcomes, drawn by their share of the bag
+    bool sparse_chance = false;
+    int sparse_min_ply = 3;
+    int sparse_samples = 4;
+};
+
 class AlphaBetaEngine{
 public:
     AlphaBetaEngine();
-    Move search(Position &pos);
+    ~AlphaBetaEngine();
+    Move search(Position &pos, const SearchLimits &limits = SearchLimits());
+    void set_threads(int n);// Lazy SMP: main thread + (n - 1) helpers
+    void set_hash(size_t mb);// TT size, not while searching
+    void stop();// ends search() or ponder() early, safe from any thread
+    uint64_t nodes_searched() const;
+    double outcomes_per_chance_node() const;// flip outcomes fully searched, last search
+    double sample_error() const;// mean standard error of the sampled chance nodes, last search
+    double first_move_cutoff_rate() const;// beta cutoffs made by the first move, last search
+    uint64_t aspiration_researches() const;// root searches redone with a wider window, last search
+    double tt_hit_rate() const;// TT probes in f4 that ended the node, last search
+    void set_params(const SearchParams &params) { params_ = params; }
 
-    static int material_table[MAT_SIZE][MAT_SIZE]; 
+    static Value material_table[MAT_SIZE][MAT_SIZE];// scaled to Value on load
     static bool table_loaded;
     void update_unrevealed(const Position &pos);
     void init_game();
+    // Searches _pos_, the opponent to move, in the background until
+    // stop_ponder(). The TT stays warm and the expected line is kept for the
+    // next search().
+    void ponder(const Position &pos);
+    void stop_ponder();
 private:
-    struct ScoredMove{
-        Move mv;
-        int score;
-    };
-    std::vector<ScoredMove> get_ordered_moves(const Position &pos, Move tt_move);
+    // helper thread, shares the TT and stop flag of its main engine
+    AlphaBetaEngine(std::shared_ptr<TranspositionTable> tt, std::atomic<bool> *stop, int thread_id);
+    Move iterative_deepening(Position &pos, int max_depth);
+    void ponder_search(Position pos);
+    bool ponder_hit(const Position &pos) const;
+    void start_helpers(const Position &pos, int max_depth);
+    void stop_helpers();
+    bool is_main() const { return thread_id_ == 0; }
+
+    Move repeated_choice(const Position &pos);
     int history_table_[SQUARE_NB][SQUARE_NB];
+    int piece_history_[SIDE_NB][SHOWN_PIECE_TYPE_NB][SQUARE_NB];// [side][piece type][to]
+    Move countermoves_[SQUARE_NB][SQUARE_NB];// [from][to] of the move answered
+    Move killers_[MAX_PLY][2];
+    int root_ply_ = 0;// pos.game_ply() at the root, for the killer slots
+    // triangular PV: pv_table_[ply] holds the line from ply up to pv_length_[ply]
+    Move pv_table_[MAX_PLY][MAX_PLY];
+    int pv_length_[MAX_PLY];
+    Move prev_pv_[MAX_PLY];// PV of the last finished iteration
+    int prev_pv_length_ = 0;
+    bool follow_pv_ = false;// the path so far is a prefix of prev_pv_
+    bool seeded_pv_ = false;// prev_pv_ came from pondering, start from it
+    void update_pv(int ply, Move mv, bool pv_child);
+    void report_iteration(int depth, Value score) const;
+    Value aspiration_search(Position &pos, int depth, Value prev_score, Move &best_move_ref);
     void age_history_table();
+    void clear_quiet_history();
+    int search_ply(const Position &pos) const;
+    QuietHistory quiet_history(const Position &pos);
+    void update_quiet_history(const Position &pos, Move mv, int depth);
 
-    double star1(const Move &mv, const Position &pos, double alpha, double beta, int depth, uint64_t key, Move &dummy_ref, int flip_budget, int cooldown);
-    double f4(Position &pos, double alpha, double beta, int depth, uint64_t key, Move &best_move_ref, const Move pv_hint = Move(), int flip_budget = MAX_FLIP_BUDGET, int cooldown = 0);
-    double eval(const Position &pos, const int depth);
-    double pos_score(const Position &pos, Color cur_color);
+    Value sample_chance(const Move &mv, Position &pos, const Piece *outcome, const int *count, int n, int depth, Move &dummy_ref, int flip_budget);
+    Value star1(const Move &mv, Position &pos, Value alpha, Value beta, int depth, Move &dummy_ref, int flip_budget, int cooldown);
+    template<NodeType NT>
+    Value f4(Position &pos, Value alpha, Value beta, int depth, Move &best_move_ref, int flip_budget, int cooldown);
+    Value search_outcome(Position &pos, Value alpha, Value beta, int depth, Move &best_move_ref, int flip_budget, int cooldown);
+    Value eval(const Position &pos, const int depth, const Color winner);
+    Value pos_score(const Position &pos, Color cur_color);
 
     double estimatePlyTime(const Position& pos);
 
     void store_choice(uint64_t key, Move mv);
     Move check_previous_choice(uint64_t key);
 
-    double qsearch(Position &pos, double alpha, double beta);
+    Value qsearch(Position &pos, Value alpha, Value beta);
+    bool count_node_and_poll();
+    void start_timer(int ms);
+    void stop_timer();
 
     bool time_out_ = false;
-    int node_count_ = 0;
+    std::atomic<uint64_t> node_count_{0};// read by the main thread while we search
+    uint64_t chance_nodes_ = 0;
+    uint64_t chance_outcomes_searched_ = 0;
+    uint64_t sampled_chance_nodes_ = 0;
+    uint64_t aspiration_researches_ = 0;
+    uint64_t tt_probes_ = 0;
+    uint64_t tt_hits_ = 0;
+    uint64_t cutoffs_ = 0;
+    uint64_t first_move_cutoffs_ = 0;
+    double sample_error_sum_ = 0;
+    pcg32 sampler_;// sparse chance nodes, one per thread
+    int root_depth_ = 0;
     int no_eat_flip = 0;
     int ply_count_ = 0;// total ply count in the game
     int prev_total_count = SQUARE_NB;
     std::chrono::time_point<std::chrono::steady_clock> start_time_{};
-    int time_limit_ms_ = 5000;
-    TranspositionTable tt_;
-    ZobristHash zobrist_;
+    int time_limit_ms_ = DEFAULT_MOVE_TIME_MS;
+    TimeManager time_manager_;
+    bool manage_time_ = false;// false with a fixed depth or move time
+    uint64_t node_limit_ = 0;
+    std::thread timer_thread_;
+    std::mutex timer_mutex_;
+    std::condition_variable timer_cv_;
+    bool timer_cancelled_ = false;
+    SearchParams params_;
+    std::shared_ptr<TranspositionTable> tt_;
+
+    int thread_id_ = 0;
+    std::atomic<bool> stop_own_{false};
+    std::atomic<bool> *stop_ = &stop_own_;// set by the main thread only
+    std::vector<std::unique_ptr<AlphaBetaEngine>> helpers_;
+    std::vector<std::thread> helper_threads_;
+
+    std::thread ponder_thread_;
+    Position ponder_root_;// opponent to move
+    Move ponder_pv_[MAX_PLY];// expected reply first, then our answer
+    int ponder_pv_length_ = 0;
 
     void load_material_table();
-    int get_material_index(const Position &pos, Color cur_color) const;
-    double try_move(const Position &pos, const Move &mv, double alpha, double beta, int depth, uint64_t key, Move &dummy_ref, int flip_budget, int cooldown);
+    template<NodeType NT>
+    Value try_move(Position &pos, const Move &mv, Value alpha, Value beta, int depth, Move &dummy_ref, int flip_budget, int cooldown);
+    void sync_bag(Position &pos) const;
 
     const int init_counts[7] = {1, 2, 2, 2, 2, 2, 5};
     int unrevealed_count[2][7];// need track both!
@@ -0,0 +1,75 @@
+#ifndef MOVE_PICKER_H
+#define MOVE_PICKER_H
+
+#include "../../lib/chess.h"
+#include "../../lib/movegen.h"
+
+// What the engine has learned about quiet moves, for the side to move
+struct QuietHistory{
+    const int (*butterfly)[SQUARE_NB] = nullptr; // [from][to]
+    const int (*piece_to)[SQUARE_NB] = nullptr;  // [piece type][to]
+    Move killers[2];                             // quiet cutoffs at this ply
+    Move countermove;                            // quiet cutoff against the last move
+};
+
+// Hands out the moves of a position one at a time, best first:
+//   TT move -> winning captures (yummy_table) -> killers, countermove
+//   -> flips -> quiet moves (history) -> losing captures (see() < 0)
+// Each stage is generated only when the previous one runs dry, and only the
+// next best move is selected, so a node that cuts off early never pays for
+// the stages after it.
+class MovePicker{
+public:
+    /*
+     * @param   pos         The position, must outlive the picker
+     * @param   tt_move     Tried first if it is legal here
+     * @param   skip        Never returned (e.g. a move that repeats an earlier choice)
+     * @param   quiet       Killers, countermove and histories, order the quiet moves
+     * @param   flips       Whether to hand out flips; they come anyway when no
+     *                      piece can move
+     */
+    MovePicker(const Position &pos, Move tt_move, Move skip, const QuietHistory &quiet, bool flips = true);
+
+    /*
+     * Winning and even captures only, for the quiescence search.
+     */
+    explicit MovePicker(const Position &pos);
+
+    /*
+     * @returns The next move, or Move() when there are none left.
+     */
+    Move next_move();
+
+    /*
+     * Whether _mv_ can be played in _pos_. Used to validate TT moves.
+     */
+    static bool is_legal(const Position &pos, Move mv);
+
+private:
+    enum Stage{ TT_STAGE, CAPTURE_INIT, CAPTURES, REFUTATIONS, FLIP_INIT, FLIPS, QUIET_INIT, QUIETS, BAD_CAPTURES, DONE };
+
+    struct ScoredMove{
+        Move mv;
+        int score;
+    };
+
+    // picks the best of [cur_, end_), the moves of the current stage
+    Move select_best();
+
+    const Position &pos_;
+    QuietHistory quiet_;
+    Move refutations_[3]; // killers and countermove, never returned twice
+    int refutation_idx_;
+    Move tt_move_;
+    Move skip_;
+    Stage stage_;
+    bool captures_only_;
+    bool flips_;
+    bool can_move_;       // a moving move other than skip_ exists
+    ScoredMove *cur_, *end_;
+    ScoredMove *begin_quiets_, *end_quiets_; // generated with the captures, scored last
+    ScoredMove *end_bad_captures_;            // parked over the front of moves_ as CAPTURES consumes it
+    ScoredMove moves_[MAX_MOVES];
+};
+
+#endif
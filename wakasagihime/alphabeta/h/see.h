@@ -0,0 +1,19 @@
+#ifndef SEE_H
+#define SEE_H
+
+#include "../../lib/chess.h"
+
+/*
+ * Static exchange evaluation of a capture, under Banqi capture rules.
+ * Both sides keep recapturing on the target square with their least valuable
+ * piece that is allowed to take the current occupant, and may stop whenever
+ * that is better for them.
+ *
+ * @param   pos The position
+ * @param   mv  A legal capture
+ * @returns The material won by the side to move, in Piece_Value units
+ *          (negative if the capture loses material)
+ */
+int see(const Position &pos, Move mv);
+
+#endif
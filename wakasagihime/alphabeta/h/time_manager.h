@@ -0,0 +1,50 @@
+#ifndef TIME_MANAGER_H
+#define TIME_MANAGER_H
+
+#include <chrono>
+#include <cstdint>
+#include "../../lib/chess.h"
+
+// How long the main thread keeps deepening on one move.
+//
+// Each move has an optimum time, scaled up while the best move keeps
+// changing or the score falls and down once the best move has been the same
+// for a while. An iteration is only started if the previous one, grown by
+// the effective branching factor, would still end within that time. The
+// maximum time is the hard limit the node loop polls against.
+class TimeManager{
+public:
+    /*
+     * @param   start       When the search started
+     * @param   optimum_ms  What the move should take
+     * @param   maximum_ms  Never more than this
+     */
+    void start(std::chrono::steady_clock::time_point start, double optimum_ms, double maximum_ms);
+
+    /*
+     * Called after every finished iteration.
+     * @param   best    Best move of the iteration
+     * @param   score   Its score
+     * @param   nodes   Nodes searched so far in this search
+     * @returns Whether the next iteration is expected to finish in time
+     */
+    bool next_iteration(Move best, Value score, uint64_t nodes);
+
+    int maximum_ms() const { return int(maximum_ms_); }
+    double elapsed_ms() const;
+
+private:
+    std::chrono::steady_clock::time_point start_;
+    double optimum_ms_ = 0, maximum_ms_ = 0;
+    double last_end_ms_ = 0;     // when the last iteration ended
+    double last_iteration_ms_ = 0;
+    uint64_t last_nodes_ = 0, last_iteration_nodes_ = 0;
+    double last_ebf_ = 0;        // branching factor of the iteration before
+    Move last_best_;
+    Value last_score_ = 0;
+    int iterations_ = 0;
+    int stable_iterations_ = 0;  // in a row with the same best move
+    double instability_ = 1.0;   // grows when the best move changes, decays otherwise
+};
+
+#endif
@@ -6,6 +6,7 @@
 #include "cdc.h"
 #include "marisa.h"
 #include "types.h"
+#include <algorithm>
 #include <cstddef>
 #include <ostream>
 #include <string>
@@ -50,6 +51,42 @@ uint8_t SquareDistance[SQUARE_NB][SQUARE_NB];
 
 Board PseudoAttacks[SQUARE_NB];
 
+uint64_t ZobristPiece[SIDE_NB][SHOWN_PIECE_TYPE_NB][SQUARE_NB];
+uint64_t ZobristHidden[SQUARE_NB];
+uint64_t ZobristSide;
+uint64_t ZobristBag[SIDE_NB][SHOWN_PIECE_TYPE_NB][SQUARE_NB + 1];
+uint64_t ZobristFifty[4];
+
+void init_zobrist()
+{
+    pcg64 rng64(42);
+    for (Color c : { Color::Red, Color::Black }) {
+        for (PieceType pt = General; pt < SHOWN_PIECE_TYPE_NB; pt += 1) {
+            for (Square sq = SQ_A1; sq < SQUARE_NB; sq += 1) {
+                ZobristPiece[c][pt][sq] = rng64();
+            }
+            // an empty slot of the bag hashes to nothing, like an empty square
+            ZobristBag[c][pt][0] = 0;
+            for (int n = 1; n <= SQUARE_NB; n += 1) {
+                ZobristBag[c][pt][n] = rng64();
+            }
+        }
+    }
+    for (Square sq = SQ_A1; sq < SQUARE_NB; sq += 1) {
+        ZobristHidden[sq] = rng64();
+    }
+    ZobristSide     = rng64();
+    ZobristFifty[0] = 0;
+    for (int i = 1; i < 4; i += 1) {
+        ZobristFifty[i] = rng64();
+    }
+}
+
+static inline uint64_t piece_key(const Piece &p, Square sq)
+{
+    return p.type == Hidden ? ZobristHidden[sq] : ZobristPiece[p.side][p.type][sq];
+}
+
 std::ostream &operator<<(std::ostream &os, const Square &sq)
 {
     os << (char)('A' + file_of(sq)) << (1 + rank_of(sq));
@@ -188,7 +225,44 @@ void Position::clear()
 
     info.fiftyMoveCount = 0;
     info.illegal        = NO_COLOR;
-    info.time_remaining = std::pair(0.0, 0.0);
+    info.time_remaining[Red]   = 0.0;
+    info.time_remaining[Black] = 0.0;
+
+    historyTop  = 0;
+    historySize = 0;
+
+    materialIndex[Red]   = 0;
+    materialIndex[Black] = 0;
+
+    // the bag is kept, see clear_collection()
+    zobristKey = (sideToMove == Black) ? ZobristSide : 0;
+    for (Color c : { Color::Red, Color::Black }) {
+        for (PieceType pt = General; pt < SHOWN_PIECE_TYPE_NB; pt += 1) {
+            zobristKey ^= ZobristBag[c][pt][bagCount[c][pt]];
+        }
+    }
+}
+
+void Position::set_side(Color c)
+{
+    if ((sideToMove == Black) != (c == Black)) {
+        zobristKey ^= ZobristSide;
+    }
+    sideToMove = c;
+}
+
+void Position::set_fifty_move_count(int fmc)
+{
+    zobristKey ^= ZobristFifty[fifty_bucket(info.fiftyMoveCount)] ^ ZobristFifty[fifty_bucket(fmc)];
+    info.fiftyMoveCount = fmc;
+}
+
+void Position::set_bag_count(Color c, PieceType pt, int n)
+{
+    assert(n >= 0 && n <= SQUARE_NB);
+    zobristKey ^= ZobristBag[c][pt][bagCount[c][pt]] ^ ZobristBag[c][pt][n];
+    bagSize += n - bagCount[c][pt];
+    bagCount[c][pt] = n;
 }
 
 Board Position::subordinates(Color c, PieceType pt) const
@@ -209,6 +283,7 @@ void Position::place_piece_at(const Piece &p, Square sq)
     }
 
     board[sq] = p;
+    zobristKey ^= piece_key(p, sq);
 
     byTypeBB[p.type] |= sq;
     byTypeBB[ALL_PIECES] |= sq;
@@ -217,6 +292,7 @@ void Position::place_piece_at(const Piece &p, Square sq)
         // is red or black (face up)
         byTypeBB[FACE_UP] |= sq;
         byColorBB[p.side] |= sq;
+        materialIndex[p.side] += MaterialWeight[p.type];
     }
 }
 
@@ -224,6 +300,9 @@ Piece Position::remove_piece_at(Square sq)
 {
     Piece p   = board[sq];
     board[sq] = Piece();
+    if (p.type != NO_PIECE) {
+        zobristKey ^= piece_key(p, sq);
+    }
 
     byTypeBB[p.type] ^= sq;
     byTypeBB[ALL_PIECES] ^= sq;
@@ -231,6 +310,7 @@ Piece Position::remove_piece_at(Square sq)
     if (p.side < SIDE_NB) {
         byTypeBB[FACE_UP] ^= sq;
         byColorBB[p.side] ^= sq;
+        materialIndex[p.side] -= MaterialWeight[p.type];
     }
 
     return p;
@@ -246,43 +326,87 @@ void Position::move_piece(Square src, Square dst)
     place_piece_at(removed, dst);
 }
 
+Piece Position::sample_collection()
+{
+    int r = rng(bagSize);
+    for (Color c : { Color::Red, Color::Black }) {
+        for (PieceType pt = General; pt < SHOWN_PIECE_TYPE_NB; pt += 1) {
+            r -= bagCount[c][pt];
+            if (r < 0) {
+                set_bag_count(c, pt, bagCount[c][pt] - 1);
+                return Piece(c, pt);
+            }
+        }
+    }
+    assert(false);
+    return Piece();
+}
+
 bool Position::flip_piece_at(Square sq)
 {
     if (peek_piece_at(sq).side != Mystery) {
         return false;
     }
-    Piece new_piece =
-        pieceCollection.empty() ? random_faceup_piece() : sample_remove(pieceCollection);
+    Piece new_piece = bagSize == 0 ? random_faceup_piece() : sample_collection();
 
     place_piece_at(new_piece, sq);
     return true;
 }
 
+bool Position::flip_piece_at(Square sq, const Piece &p)
+{
+    if (peek_piece_at(sq).side != Mystery) {
+        return false;
+    }
+    if (bagCount[p.side][p.type] == 0) {
+        return false;
+    }
+    set_bag_count(p.side, p.type, bagCount[p.side][p.type] - 1);
+
+    place_piece_at(p, sq);
+    return true;
+}
+
 void Position::add_collection(Piece *set, size_t n)
 {
     if (set == nullptr) {
         // use default piece set
+        static const int SET_COUNTS[MOVABLE_PIECE_TYPE_NB] = { 1, 2, 2, 2, 2, 2, 5 };
         for (Color s : { Color::Red, Color::Black }) {
-            // clang-format off
-            pieceCollection
-                << Piece(s, General)
-                << Piece(s, Advisor)  << Piece(s, Advisor)
-                << Piece(s, Elephant) << Piece(s, Elephant)
-                << Piece(s, Chariot)  << Piece(s, Chariot)
-                << Piece(s, Horse)    << Piece(s, Horse)
-                << Piece(s, Cannon)   << Piece(s, Cannon)
-                << Piece(s, Soldier)  << Piece(s, Soldier)
-                << Piece(s, Soldier)  << Piece(s, Soldier)
-                << Piece(s, Soldier);
-            // clang-format on
+            for (PieceType pt = General; pt < MOVABLE_PIECE_TYPE_NB; pt += 1) {
+                set_bag_count(s, pt, bagCount[s][pt] + SET_COUNTS[pt]);
+            }
         }
         return;
     }
 
     // Use provided n pieces
     for (int i = 0; i < n; i += 1) {
-        pieceCollection << set[i];
+        assert(set[i].side < SIDE_NB && set[i].type < SHOWN_PIECE_TYPE_NB);
+        set_bag_count(set[i].side, set[i].type, bagCount[set[i].side][set[i].type] + 1);
+    }
+}
+
+void Position::clear_collection()
+{
+    for (Color c : { Color::Red, Color::Black }) {
+        for (PieceType pt = General; pt < SHOWN_PIECE_TYPE_NB; pt += 1) {
+            set_bag_count(c, pt, 0);
+        }
+    }
+}
+
+std::vector<Piece> Position::get_collection() const
+{
+    std::vector<Piece> v;
+    for (Color c : { Color::Red, Color::Black }) {
+        for (PieceType pt = General; pt < SHOWN_PIECE_TYPE_NB; pt += 1) {
+            for (int i = 0; i < bagCount[c][pt]; i += 1) {
+                v << Piece(c, pt);
+            }
+        }
     }
+    return v;
 }
 
 void Position::setup(int hidden)
@@ -322,18 +446,18 @@ void Position::readFEN(std::string fen)
                 }
                 break;
             case 4:
-                sideToMove = (token.compare("b") == 0) ? Black : Red;
+                set_side((token.compare("b") == 0) ? Black : Red);
                 break;
             case 5:
                 try {
-                    info.time_remaining.first = std::stod(token);
+                    info.time_remaining[Red] = std::stod(token);
                 } catch (...) {
                     error << "Failed to parse first time!\n";
                 }
                 break;
             case 6:
                 try {
-                    info.time_remaining.second = std::stod(token);
+                    info.time_remaining[Black] = std::stod(token);
                 } catch (...) {
                     error << "Failed to parse second time!\n";
                 }
@@ -377,26 +501,7 @@ bool Position::do_move(const Move &mv)
     if (mv.type() == Flipping) {
         Square sq = mv.from();
         if ((success = flip_piece_at(sq))) {
-            /*
-             * @note This is relevant for HW3 only.
-             *
-             * You are always assigned a side (Red/Black) at the start of a game.
-             * In dark chess games, the first player to go is assigned "Red."
-             * If that player then flips a Black piece, they become Black for the rest of the game.
-             *
-             */
-            bool first_flip    = (__builtin_popcount(pieces(Hidden)) == 31);
-            bool flipped_black = (pieces(Black) & mv.from());
-            if (!first_flip || !flipped_black) {
-                sideToMove = ~sideToMove;
-            }
-
-            // record flip
-            history.push(PastMove {
-                .mv      = mv,
-                .p       = peek_piece_at(sq),
-                .fmc_old = info.fiftyMoveCount,
-            });
+            record_flip(mv);
         }
         return success;
     }
@@ -431,29 +536,74 @@ bool Position::do_move(const Move &mv)
     move_piece(from, to);
 
     // record move
-    history.push(PastMove {
+    push_history(PastMove {
         .mv      = mv,
+        .fmc_old = uint16_t(info.fiftyMoveCount),
         .p       = dst,
-        .fmc_old = info.fiftyMoveCount,
     });
 
-    sideToMove = ~sideToMove;
-    info.fiftyMoveCount = (dst.type == NO_PIECE) ? info.fiftyMoveCount + 1 : 0;
+    set_side(~sideToMove);
+    set_fifty_move_count((dst.type == NO_PIECE) ? info.fiftyMoveCount + 1 : 0);
     return true;
 }
 
+bool Position::do_move(const Move &mv, const Piece &p)
+{
+    if (mv.type() != Flipping) {
+        return do_move(mv);
+    }
+    if (!flip_piece_at(mv.from(), p)) {
+        return false;
+    }
+    record_flip(mv);
+    return true;
+}
+
+void Position::push_history(const PastMove &pmv)
+{
+    history[historyTop & (HISTORY_CAPACITY - 1)] = pmv;
+    historyTop += 1;
+    if (historySize < HISTORY_CAPACITY) {
+        historySize += 1;
+    }
+}
+
+void Position::record_flip(const Move &mv)
+{
+    /*
+     * @note This is relevant for HW3 only.
+     *
+     * You are always assigned a side (Red/Black) at the start of a game.
+     * In dark chess games, the first player to go is assigned "Red."
+     * If that player then flips a Black piece, they become Black for the rest of the game.
+     *
+     */
+    bool first_flip    = (__builtin_popcount(pieces(Hidden)) == 31);
+    bool flipped_black = (pieces(Black) & mv.from());
+    if (!first_flip || !flipped_black) {
+        set_side(~sideToMove);
+    }
+
+    // record flip
+    push_history(PastMove {
+        .mv      = mv,
+        .fmc_old = uint16_t(info.fiftyMoveCount),
+        .p       = peek_piece_at(mv.from()),
+    });
+}
+
 bool Position::undo_move()
 {
-    if (history.size() == 0) {
+    if (historySize == 0) {
         return false;
     }
 
-    PastMove pmv = history.top();
+    PastMove pmv = history[(historyTop - 1) & (HISTORY_CAPACITY - 1)];
     // restore board state
     switch (pmv.mv.type()) {
         case Moving:
         move_piece(pmv.mv.to(), pmv.mv.from()); // move back
-        info.fiftyMoveCount = pmv.fmc_old;      // restore count
+        set_fifty_move_count(pmv.fmc_old);      // restore count
         if (pmv.p.type != NO_PIECE) {           // restore captured piece
             place_piece_at(pmv.p, pmv.mv.to());
         }
@@ -465,8 +615,8 @@ bool Position::undo_move()
             return false;
         }
         place_piece_at(Piece(Mystery, Hidden), pmv.mv.from());
-        info.fiftyMoveCount = pmv.fmc_old;
-        pieceCollection << pmv.p;
+        set_fifty_move_count(pmv.fmc_old);
+        set_bag_count(pmv.p.side, pmv.p.type, bagCount[pmv.p.side][pmv.p.type] + 1);
         break;
 
         default:
@@ -474,8 +624,12 @@ bool Position::undo_move()
         return false;
     }
 
-    history.pop();
-    sideToMove = ~sideToMove; // kurwa zapomnialem
+    historyTop -= 1;
+    historySize -= 1;
+    // flipping Black first keeps the side to move, see record_flip()
+    if (pmv.mv.type() != Flipping || count(Hidden) != SQUARE_NB || pmv.p.side != Black) {
+        set_side(~sideToMove); // kurwa zapomnialem
+    }
     return true;
 }
 
@@ -486,9 +640,9 @@ double Position::time_left(Color color) const
     }
     switch (color) {
         case Red:
-            return info.time_remaining.first;
+            return info.time_remaining[Red];
         case Black:
-            return info.time_remaining.second;
+            return info.time_remaining[Black];
         default:
             return 0.0;
     }
@@ -505,16 +659,14 @@ Color Position::winner(WinCon *wc) const
     }
 
     // No legal moves
-    MoveList<All, Black> moves_b(*this);
-    if (moves_b.size() == 0) {
+    if (!has_any_move(Black)) {
         if (wc) {
             *wc = count(Black) > 0 ? WinCon::DeadPosition : WinCon::Elimination;
         }
         return Red;
     }
 
-    MoveList<All, Red> moves_r(*this);
-    if (moves_r.size() == 0) {
+    if (!has_any_move(Red)) {
         if (wc) {
             *wc = count(Red) > 0 ? WinCon::DeadPosition : WinCon::Elimination;
         }
@@ -535,6 +687,29 @@ Color Position::winner(WinCon *wc) const
     return NO_COLOR;
 }
 
+bool Position::has_any_move(Color c) const
+{
+    // anyone may flip
+    if (byTypeBB[Hidden]) {
+        return true;
+    }
+
+    Board occupied = byTypeBB[ALL_PIECES];
+    for (PieceType pt = General; pt < MOVABLE_PIECE_TYPE_NB; pt += 1) {
+        Board bb = pieces(c, pt);
+        if (bb == 0) {
+            continue;
+        }
+        Board target = subordinates(c, pt) | ~occupied;
+        for (Square from : BoardView(bb)) {
+            if (attacks_bb(pt, from, occupied) & target) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
 int Position::simulate(Move (*strategy)(MoveList<> &moves))
 {
     Position copy(*this);
@@ -10,12 +10,12 @@
 #include "types.h"
 
 #include <array>
-#include <stack>
 #include <cassert>
 #include <csignal>
 #include <cstdint>
 #include <cstring>
 #include <optional>
+#include <type_traits>
 
 // -~ Colors ~-
 
@@ -211,6 +211,35 @@ template<PieceType pt>
 Board attacks_bb(Square sq, Board occupied);
 Board attacks_bb(PieceType pt, Square sq, Board occupied);
 
+// -~ Zobrist keys ~-
+extern uint64_t ZobristPiece[SIDE_NB][SHOWN_PIECE_TYPE_NB][SQUARE_NB];
+extern uint64_t ZobristHidden[SQUARE_NB];
+extern uint64_t ZobristSide;                                            // Black to move
+extern uint64_t ZobristBag[SIDE_NB][SHOWN_PIECE_TYPE_NB][SQUARE_NB + 1]; // by count left
+extern uint64_t ZobristFifty[4];                                        // by fifty_bucket()
+
+/*
+ * Fills the Zobrist key tables. Call once before making any Position.
+ */
+void init_zobrist();
+
+/*
+ * Weight of each piece in the mixed-radix material index, see Position::material_index().
+ * (1 general, 2 advisors, ... 5 soldiers => radices 2, 3, 3, 3, 3, 3, 6)
+ */
+constexpr int MaterialWeight[SHOWN_PIECE_TYPE_NB] = { 1458, 486, 162, 54, 18, 6, 1, 0 };
+
+/*
+ * Coarse bucket of the fifty-move counter that goes into the Zobrist key:
+ * 0-9, 10-19, 20-29 and 30+, the last being a draw (see Position::winner()).
+ */
+constexpr int fifty_bucket(int fmc) { return fmc < 30 ? fmc / 10 : 3; }
+
+/*
+ * Moves a Position can undo. Enough for a search, see MAX_SEARCH_DEPTH.
+ */
+constexpr int HISTORY_CAPACITY = 64;
+
 // -~ Move ~-
 std::ostream &operator<<(std::ostream &os, const Move &mv);
 std::istream &operator>>(std::istream &is, Move &mv);
@@ -224,9 +253,35 @@ class Position {
     Board byColorBB[SIDE_NB];
     // Data
     Color sideToMove;
-    std::vector<Piece> pieceCollection;
     StateInfo info;
-    std::stack<PastMove> history;
+    // The bag of face-down pieces, as a count per piece
+    uint8_t bagCount[SIDE_NB][SHOWN_PIECE_TYPE_NB];
+    uint8_t bagSize;
+    // Ring buffer of past moves, the oldest ones are overwritten when full
+    PastMove history[HISTORY_CAPACITY];
+    uint16_t historyTop;  // next slot to write
+    uint16_t historySize; // number of moves that can be undone
+    // Zobrist key, kept up to date by every change below
+    uint64_t zobristKey;
+    // Face-up material of each side, see material_index()
+    int materialIndex[SIDE_NB];
+
+    void set_side(Color c);
+    void set_fifty_move_count(int fmc);
+    void set_bag_count(Color c, PieceType pt, int n);
+
+    /*
+     * Draws a uniformly random piece from the bag. The bag must not be empty.
+     * @internal
+     */
+    Piece sample_collection();
+
+    /*
+     * Side to move and history bookkeeping after a successful flip.
+     * @internal
+     */
+    void record_flip(const Move &mv);
+    void push_history(const PastMove &pmv);
 
     public:
     /*
@@ -234,6 +289,8 @@ class Position {
      */
     Position()
       : sideToMove(Red)
+      , bagCount {}
+      , bagSize(0)
     {
         clear();
     }
@@ -243,6 +300,9 @@ class Position {
      * @param   fen The FEN string
      */
     Position(std::string fen)
+      : sideToMove(Red)
+      , bagCount {}
+      , bagSize(0)
     {
         clear();
         readFEN(fen);
@@ -270,11 +330,15 @@ class Position {
     /*
      * Clears the bag for face-down pieces.
      */
-    void clear_collection() { pieceCollection.clear(); }
+    void clear_collection();
     /*
      * Get all remaining unrevealed pieces.
      */
-    std::vector<Piece> get_collection() { return pieceCollection; }
+    std::vector<Piece> get_collection() const;
+    /*
+     * Counts the pieces of one kind left in the bag.
+     */
+    int bag_count(Color c, PieceType pt) const { return bagCount[c][pt]; }
 
     /*
      * Makes a position from a FEN-like string.
@@ -301,11 +365,45 @@ class Position {
      */
     Color winner(WinCon *wc = nullptr) const;
 
+    /*
+     * Checks whether a side has any legal move, stopping at the first one found.
+     * This is what winner() uses instead of generating full MoveLists.
+     * @param   c   Red or Black
+     */
+    bool has_any_move(Color c) const;
+
     /*
      * @returns Red/Black   The color to play.
      */
     Color due_up() const { return sideToMove; }
 
+    /*
+     * @returns The Zobrist key of the board, the side to move, the bag of
+     *          face-down pieces and a coarse fifty-move count.
+     */
+    uint64_t key() const { return zobristKey; }
+
+    /*
+     * Mixed-radix index of the face-up material of a side:
+     * soldiers + 6 * cannons + 18 * horses + ... + 1458 * generals.
+     * @param   c   Red or Black
+     */
+    int material_index(Color c) const { return materialIndex[c]; }
+
+    /*
+     * Number of moves made on this position since it was set up, undone
+     * moves excluded. Only differences of it are meaningful.
+     */
+    int game_ply() const { return historyTop; }
+
+    /*
+     * @returns The last move that can be undone, or Move() if there is none.
+     */
+    Move last_move() const
+    {
+        return historySize ? history[(historyTop - 1) & (HISTORY_CAPACITY - 1)].mv : Move();
+    }
+
     /*
      * Gets the time remaining.
      * Not available for HW1.
@@ -434,6 +532,15 @@ class Position {
      */
     bool flip_piece_at(Square sq);
 
+    /*
+     * Flips a face-down piece into a chosen piece.
+     * @param   sq  The square
+     * @param   p   The piece to reveal. It is taken out of the bag.
+     * @returns Whether the flip was successful
+     * @note    Fails if _p_ is not in the bag.
+     */
+    bool flip_piece_at(Square sq, const Piece &p);
+
     /*
      * Performs a move.
      * @param   mv  The move to perform
@@ -442,7 +549,17 @@ class Position {
     bool do_move(const Move &mv);
 
     /*
-     * Undoes the last successful move. This may be called multiple times.
+     * Performs a flip with a chosen outcome, e.g. to walk through the outcomes
+     * of a chance node. Undo it with undo_move() like any other move.
+     * @param   mv  The flip to perform
+     * @param   p   The piece to reveal, see flip_piece_at(Square, const Piece &)
+     * @return  Whether the move was successful
+     */
+    bool do_move(const Move &mv, const Piece &p);
+
+    /*
+     * Undoes the last successful move. This may be called multiple times,
+     * for up to the last HISTORY_CAPACITY moves.
      *
      * The following are restored:
      *      - board state
@@ -468,6 +585,8 @@ class Position {
     int simulate(Move (*strategy)(MoveList<> &moves));
 };
 
+static_assert(std::is_trivially_copyable<Position>::value, "Position is copied with memcpy");
+
 std::ostream &operator<<(std::ostream &os, const Position &pos);
 
 #endif
\ No newline at end of file
@@ -70,8 +70,9 @@ extern const char PIECE2CHAR[SIDE_NB][REAL_PIECE_TYPE_NB];
 extern const std::string PIECE2WIDECHAR[SIDE_NB][REAL_PIECE_TYPE_NB];
 
 struct Piece {
-    Color side;
-    PieceType type;
+    // bit-fields keep a Piece in 4 bytes, so the board is two cache lines
+    Color side : 8;
+    PieceType type : 8;
 
     /*
      * No piece.
@@ -188,11 +189,7 @@ class Move {
     }
 
     constexpr operator uint16_t() { return raw; }
-    constexpr Move &operator=(const Move &other)
-    {
-        raw = other.raw;
-        return *this;
-    }
+    constexpr Move &operator=(const Move &other) = default;
     bool operator<(const Move &other) const { return raw < other.raw; }
     bool operator>(const Move &other) const { return raw > other.raw; }
     bool operator<=(const Move &other) const { return raw <= other.raw; }
@@ -208,6 +205,13 @@ class Move {
     Square to() const { return Square((raw >> 5) & 0x1F); }
 };
 
+// -~ Values ~-
+// Search scores, fixed point with VALUE_SCALE steps per material unit. 80 is
+// the largest scale that keeps the 0.05 steps of the distance bonus exact
+// and fits win scores in the 16 bits of a TT entry.
+typedef int Value;
+constexpr Value VALUE_SCALE = 80;
+
 // -~ WinCon ~-
 // Win conditions
 class WinCon {
@@ -242,15 +246,15 @@ class WinCon {
 struct StateInfo {
     int fiftyMoveCount;
     Color illegal;
-    std::pair<double, double> time_remaining; // RED, BLACK
+    double time_remaining[SIDE_NB]; // indexed by Color
 };
 
 // -~ PastMoves ~-
 // Records moves done, for unwinding
 struct PastMove {
     Move mv;
-    Piece p;        // Either the piece flipped, or the piece captured
-    int fmc_old;    // save the fifty move counter
+    uint16_t fmc_old; // save the fifty move counter
+    Piece p;          // Either the piece flipped, or the piece captured
 };
 
 class Position;
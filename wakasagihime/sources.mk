@@ -6,5 +6,7 @@ CHINESE = 1
 
 # +-- Add your own sources here, if any --+
 ADD_SOURCES = alphabeta/cpp/alphabeta.cpp \
-			  tt/cpp/transposition_table.cpp \
-			  tt/cpp/zobrist.cpp
\ No newline at end of file
+			  alphabeta/cpp/move_picker.cpp \
+			  alphabeta/cpp/see.cpp \
+			  alphabeta/cpp/time_manager.cpp \
+			  tt/cpp/transposition_table.cpp
\ No newline at end of file
@@ -1,42 +1,180 @@
 #include "../h/transposition_table.h"
+#include "../../lib/helper.h"
 #include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 
-bool TranspositionTable::probe(uint64_t hash, double &alpha, double &beta, const int depth, double &ret_score, Move &tt_move){
-    size_t index = hash & TT_MASK; // hash % TT_SIZE
-    TT_Entry &entry = table[index];
-    if(entry.hash == hash){
-        if(entry.depth >= depth){
-            tt_move = entry.best_move;
-            if(entry.flag == TT_EXACT){
-                ret_score = entry.score;
-                return true;
-            }
-            else if(entry.flag == TT_ALPHA){
-                // failed low
-                beta = std::min(beta, entry.score);
-            }
-            else if(entry.flag == TT_BETA){
-                // failed high
-                alpha = std::max(alpha, entry.score);
-            }
+static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+// depth an entry loses per search it is old. Depths are small here, so
+// anything more than one evicts still useful entries of the last move.
+static constexpr int TT_AGE_WEIGHT = 1;
 
-            if(alpha >= beta){
-                ret_score = entry.score;
-                return true;
-            }
+// Real scores fit in 16 bits, the clamp only keeps INF from wrapping
+static int16_t to_tt_score(Value score){
+    return int16_t(std::max(-32767, std::min(32767, score)));
+}
+
+TranspositionTable::~TranspositionTable(){
+    std::free(table);
+}
+
+void TranspositionTable::resize(size_t mb){
+    // past MAX_MB the byte count below could overflow
+    mb = std::max<size_t>(1, std::min(mb, MAX_MB));
+    size_t clusters = 1;
+    while(clusters * 2 * sizeof(TT_Cluster) <= mb * 1024 * 1024) clusters *= 2;
+
+    std::free(table);
+    bytes = clusters * sizeof(TT_Cluster);
+    // a big table is aligned to huge pages so the kernel can back it with them
+    size_t alignment = bytes >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : alignof(TT_Cluster);
+    table = static_cast<TT_Cluster *>(std::aligned_alloc(alignment, bytes));
+    if(!table){
+        error << "TranspositionTable: could not allocate " << mb << " MB\n";
+        std::exit(EXIT_FAILURE);
+    }
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if(alignment == HUGE_PAGE_SIZE) madvise(table, bytes, MADV_HUGEPAGE);
+#endif
+    mask = clusters - 1;
+    clear();
+}
+
+uint64_t TT_Data::pack() const{
+    uint64_t word = 0;
+    std::memcpy(&word, this, sizeof(TT_Data));
+    return word;
+}
+
+TT_Data TT_Data::unpack(uint64_t word){
+    TT_Data data;
+    std::memcpy(&data, &word, sizeof(TT_Data));
+    return data;
+}
+
+void TranspositionTable::clear(){
+    for(size_t i = 0; i <= mask; i++){
+        for(TT_Entry &entry : table[i].entry){
+            entry.key_xor_data.store(0, std::memory_order_relaxed);
+            entry.data.store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+void TranspositionTable::write(TT_Entry &entry, uint64_t hash, const TT_Data &data){
+    uint64_t word = data.pack();
+    entry.data.store(word, std::memory_order_relaxed);
+    entry.key_xor_data.store(hash ^ word, std::memory_order_relaxed);
+}
+
+TT_Entry *TranspositionTable::find(uint64_t hash, TT_Data &data){
+    TT_Cluster &c = cluster(hash);
+    for(TT_Entry &entry : c.entry){
+        uint64_t word = entry.data.load(std::memory_order_relaxed);
+        if(word && (entry.key_xor_data.load(std::memory_order_relaxed) ^ word) == hash){
+            data = TT_Data::unpack(word);
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+// An entry that answered a probe joins the current search, it is still
+// reachable. One that did not is searched again and stored over, see store().
+void TranspositionTable::refresh(TT_Entry &entry, uint64_t hash, TT_Data data){
+    if(data.generation() == generation) return;
+    data.genflag8 = uint8_t(generation << 3 | data.flag());
+    write(entry, hash, data);
+}
+
+bool TranspositionTable::probe(uint64_t hash, Value &alpha, Value &beta, const int depth, Value &ret_score, Move &tt_move){
+    TT_Data entry;
+    TT_Entry *found = find(hash, entry);
+    if(found && entry.depth() >= depth){
+        Value score = entry.score16;
+        tt_move = entry.best_move;
+        if(entry.flag() == TT_EXACT){
+            refresh(*found, hash, entry);
+            ret_score = score;
+            return true;
+        }
+        else if(entry.flag() == TT_ALPHA){
+            // failed low
+            beta = std::min(beta, score);
+        }
+        else if(entry.flag() == TT_BETA){
+            // failed high
+            alpha = std::max(alpha, score);
+        }
+
+        if(alpha >= beta){
+            refresh(*found, hash, entry);
+            ret_score = score;
+            return true;
         }
     }
     return false;
 }
 
-void TranspositionTable::store(uint64_t hash, const double score, const int depth, const TT_Flag flag, const Move &best_move){
-    size_t index = hash & TT_MASK; // hash % TT_SIZE
-    TT_Entry &entry = table[index];
-    if (entry.hash != hash || depth >= entry.depth) {
-        entry.hash = hash;
-        entry.score = score;
-        entry.depth = depth;
-        entry.flag = flag;
-        entry.best_move = best_move;
+// The same position is only overwritten by a search at least as deep, unless
+// the entry is left from an earlier search. Otherwise the entry of the
+// cluster worth the least goes: shallow and from an old generation.
+void TranspositionTable::store(uint64_t hash, const Value score, const int depth, const TT_Flag flag, const Move &best_move){
+    TT_Data old;
+    TT_Entry *replace = find(hash, old);
+    if(replace){
+        if(depth < old.depth() && old.generation() == generation) return;
+    }
+    else{
+        TT_Cluster &c = cluster(hash);
+        int least = 0;
+        for(TT_Entry &entry : c.entry){
+            TT_Data data = TT_Data::unpack(entry.data.load(std::memory_order_relaxed));
+            int age = (generation - data.generation()) & 31;
+            int worth = int(data.depth8) - TT_AGE_WEIGHT * age;
+            if(!replace || worth < least){
+                replace = &entry;
+                least = worth;
+            }
+        }
     }
-}
\ No newline at end of file
+
+    TT_Data data;
+    data.best_move = best_move;
+    data.score16 = to_tt_score(score);
+    data.depth8 = uint8_t(depth + 1);
+    data.genflag8 = uint8_t(generation << 3 | flag);
+    write(*replace, hash, data);
+}
+
+uint64_t TranspositionTable::chance_key(uint64_t hash, Square sq){
+    // splitmix64 of the square, so the key never meets an ordinary one
+    uint64_t z = (uint64_t(sq) + 1) * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return hash ^ z ^ (z >> 31);
+}
+
+bool TranspositionTable::probe_chance(uint64_t hash, Square sq, const Value alpha, const Value beta, const int depth, Value &ret_score){
+    TT_Data entry;
+    uint64_t key = chance_key(hash, sq);
+    TT_Entry *found = find(key, entry);
+    if(!found || entry.depth() < depth) return false;
+
+    Value score = entry.score16;
+    if(entry.flag() == TT_CHANCE_EXACT
+       || (entry.flag() == TT_CHANCE_UPPER && score <= alpha)
+       || (entry.flag() == TT_CHANCE_LOWER && score >= beta)){
+        refresh(*found, key, entry);
+        ret_score = score;
+        return true;
+    }
+    return false;
+}
+
+void TranspositionTable::store_chance(uint64_t hash, Square sq, const Value score, const int depth, const TT_Flag flag){
+    store(chance_key(hash, sq), score, depth, flag, Move());
+}
@@ -1,38 +1,89 @@
 #ifndef TRANSPOSITION_TABLE_H
 #define TRANSPOSITION_TABLE_H
 
-#include <unordered_map>
-#include <vector>
-#include "zobrist.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include "../../lib/chess.h"
 
 enum TT_Flag{
     TT_EXACT,
     TT_ALPHA,// failed low, upper bound
-    TT_BETA // failed high, lower bound
+    TT_BETA,// failed high, lower bound
+    // chance nodes, the score is the expected value over the flip outcomes
+    TT_CHANCE_EXACT,
+    TT_CHANCE_UPPER,
+    TT_CHANCE_LOWER
 };
 
+// What an entry says about a position, 6 bytes packed into one word
+struct TT_Data{
+    Move best_move;
+    int16_t score16;  // a Value, win scores fit
+    uint8_t depth8;   // depth + 1, 0 for an empty entry
+    uint8_t genflag8; // generation << 3 | TT_Flag
+
+    int depth() const { return int(depth8) - 1; }
+    TT_Flag flag() const { return TT_Flag(genflag8 & 7); }
+    uint8_t generation() const { return genflag8 >> 3; }
+
+    uint64_t pack() const;
+    static TT_Data unpack(uint64_t word);
+};
+
+// 16 bytes in two words, the first the key XOR the second. Threads read and
+// write the words without a lock: a word torn by a concurrent store fails
+// the key check and reads as a miss.
 struct TT_Entry{
-    uint64_t hash; // 8 bytes
-    int depth; // 4 bytes
-    double score; // 8 bytes
-    uint8_t flag; // 1 byte (uint8_t)
-    Move best_move; // 2 bytes
-    TT_Entry()
-      : hash(0), depth(0), score(0), flag(TT_EXACT)
-    {}
+    std::atomic<uint64_t> key_xor_data;
+    std::atomic<uint64_t> data;
 };
 
+// One cache line
+struct alignas(64) TT_Cluster{
+    static constexpr int SIZE = 4;
+    TT_Entry entry[SIZE];
+};
+static_assert(sizeof(TT_Data) <= sizeof(uint64_t), "TT_Data should fit in a word");
+static_assert(sizeof(TT_Cluster) == 64, "TT_Cluster should be one cache line");
 
 class TranspositionTable{
 public:
-    static constexpr size_t TT_SIZE = 1 << 20; 
-    static constexpr size_t TT_MASK = TT_SIZE - 1;
-    TranspositionTable() : table(TT_SIZE) {}
+    static constexpr size_t DEFAULT_MB = 32;
+    static constexpr size_t MAX_MB = 65536;
 
-    bool probe(uint64_t hash, double &alpha, double &beta, const int depth, double &ret_score, Move &tt_move);
-    void store(uint64_t hash, const double score, const int depth, const TT_Flag flag, const Move &best_move);
+    explicit TranspositionTable(size_t mb = DEFAULT_MB) { resize(mb); }
+    ~TranspositionTable();
+    TranspositionTable(const TranspositionTable &) = delete;
+    TranspositionTable &operator=(const TranspositionTable &) = delete;
+
+    // Largest power of two clusters that fit in _mb_ megabytes, emptied
+    void resize(size_t mb);
+    void clear();
+    // Called once per search, entries of earlier searches become stale
+    void new_search() { generation = (generation + 1) & 31; }
+
+    // Starts loading the cluster of _hash_, for a probe a little later
+    void prefetch(uint64_t hash) { __builtin_prefetch(&cluster(hash)); }
+
+    bool probe(uint64_t hash, Value &alpha, Value &beta, const int depth, Value &ret_score, Move &tt_move);
+    void store(uint64_t hash, const Value score, const int depth, const TT_Flag flag, const Move &best_move);
+
+    // A flip at _sq_ from the position _hash_, stored under its own key.
+    // _score_ is from the side that flips, like star1().
+    bool probe_chance(uint64_t hash, Square sq, const Value alpha, const Value beta, const int depth, Value &ret_score);
+    void store_chance(uint64_t hash, Square sq, const Value score, const int depth, const TT_Flag flag);
 
 private:
-    std::vector<TT_Entry> table;
+    static uint64_t chance_key(uint64_t hash, Square sq);
+    TT_Entry *find(uint64_t hash, TT_Data &data);
+    void write(TT_Entry &entry, uint64_t hash, const TT_Data &data);
+    void refresh(TT_Entry &entry, uint64_t hash, TT_Data data);
+    TT_Cluster &cluster(uint64_t hash) { return table[hash & mask]; }
+
+    TT_Cluster *table = nullptr;
+    size_t mask = 0;
+    size_t bytes = 0;
+    uint8_t generation = 0;
 };
-#endif
\ No newline at end of file
+#endif
@@ -6,7 +6,10 @@
 #include "lib/types.h"
 #include "lib/helper.h"
 #include "alphabeta/h/alphabeta.h"
-#include "tt/h/zobrist.h"
+#include <cstdlib>
+#include <sstream>
+#include <future>
+#include <string>
 
 // Girls are preparing...
 __attribute__((constructor)) void prepare()
@@ -30,29 +33,205 @@ __attribute__((constructor)) void prepare()
 
     // Prepare magic
     init_magic<Cannon>(cannonTable, cannonMagics);
+
+    // Prepare hash keys
+    init_zobrist();
+}
+
+// Positions for `./wakasagi bench`, picked from random games at various stages
+// (raw strings so that "??/" is not read as a trigraph)
+static const char *BENCH_FENS[] = {
+    R"(??????c?/?????k??/?N???1??/??N????? b)",
+    R"(a1??p1R?/??RN????/?a???p??/?????C?? b)",
+    R"(?1CP?e1?/?R????r?/kE?p????/2A?p??r b)",
+    R"(RP1??2a/1???1???/?p?1a2r/P1r????n r)",
+    R"(1AEP???1/P?1?nE2/P?2P2c/?1a4C b)",
+    R"(?k2aa?p/p7/2p5/pn1eec2 b)",
+};
+
+// Searches every bench position to a fixed depth and reports nodes/second
+static int bench(AlphaBetaEngine &engine, int depth)
+{
+    SearchLimits limits;
+    limits.depth = depth;
+
+    uint64_t total_nodes = 0, researches = 0;
+    double outcomes = 0, sample_error = 0, first_move_cuts = 0, tt_hits = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const char *fen : BENCH_FENS) {
+        Position pos(std::string(fen) + " 600000 600000");
+        engine.init_game();
+        Move mv = engine.search(pos, limits);
+        total_nodes += engine.nodes_searched();
+        outcomes += engine.outcomes_per_chance_node();
+        sample_error += engine.sample_error();
+        first_move_cuts += engine.first_move_cutoff_rate();
+        tt_hits += engine.tt_hit_rate();
+        researches += engine.aspiration_researches();
+        debug << "bench: " << fen << " -> " << mv;
+    }
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+
+    info << "Nodes searched  : " << total_nodes << "\n"
+         << "Total time (ms) : " << ms << "\n"
+         << "Nodes/second    : " << total_nodes * 1000 / std::max<long long>(ms, 1) << "\n"
+         << "Outcomes/chance : " << outcomes / (sizeof(BENCH_FENS) / sizeof(*BENCH_FENS)) << "\n"
+         << "Sample error    : " << sample_error / (sizeof(BENCH_FENS) / sizeof(*BENCH_FENS)) << "\n"
+         << "First-move cuts : " << 100 * first_move_cuts / (sizeof(BENCH_FENS) / sizeof(*BENCH_FENS)) << "%\n"
+         << "TT hits         : " << 100 * tt_hits / (sizeof(BENCH_FENS) / sizeof(*BENCH_FENS)) << "%\n"
+         << "Re-searches     : " << researches << std::endl;
+    return 0;
+}
+
+// _s_ as a positive number, 0 if it is not one
+static long positive(const std::string &s)
+{
+    char *end;
+    long n = std::strtol(s.c_str(), &end, 10);
+    return (!s.empty() && *end == '\0' && n > 0) ? n : 0;
+}
+
+// Reads "go" arguments: depth N, nodes N, movetime MS
+static SearchLimits parse_go(std::istringstream &in)
+{
+    SearchLimits limits;
+    std::string token;
+    while (in >> token) {
+        if (token == "depth") in >> limits.depth;
+        else if (token == "nodes") in >> limits.nodes;
+        else if (token == "movetime") in >> limits.movetime_ms;
+        else error << "go: unknown limit " << token << "\n";
+    }
+    return limits;
 }
 
 // le fishe
-int main()
+// usage: wakasagi [threads] [-noponder] [-hash MB]
+//        wakasagi bench [depth] [threads] [-lmr] [-futility] [-rfp] [-star2] [-flips] [+sparse]
+//
+// Besides a FEN, which is searched right away on our turn, stdin takes
+//      position <FEN>                  set the position without searching
+//      go [depth N] [nodes N] [movetime MS]
+//      stop                            play the best move found so far
+//      setoption name Hash value MB
+//      setoption name Threads value N
+//      quit
+// The search runs on its own thread, so these are read while it thinks.
+int main(int argc, char *argv[])
 {
     std::string line;
     auto engine = std::make_unique<AlphaBetaEngine>();
-    Move prev_move;
+
+    if (argc > 1 && std::string(argv[1]) == "bench") {
+        // the first number is the depth and the second the thread count,
+        // switches turn a pruning technique off and may come anywhere
+        int depth = 4, threads = 1, numbers = 0;
+        SearchParams params;
+        for (int i = 2; i < argc; i++) {
+            std::string opt = argv[i];
+            long n = positive(opt);
+            if (n && numbers == 0) depth = int(n), numbers++;
+            else if (n && numbers == 1) threads = int(n), numbers++;
+            else if (opt == "-lmr") params.lmr = false;
+            else if (opt == "-futility") params.futility = false;
+            else if (opt == "-rfp") params.reverse_futility = false;
+            else if (opt == "-star2") params.star2 = false;
+            else if (opt == "-flips") params.flip_limits = false;
+            else if (opt == "+sparse") params.sparse_chance = true;
+            else error << "bench: unknown switch " << opt << "\n";
+        }
+        engine->set_threads(threads);
+        engine->set_params(params);
+        return bench(*engine, depth);
+    }
+    // think on the opponent's clock unless told not to
+    bool ponder = true;
+    for (int i = 1; i < argc; i++) {
+        std::string opt = argv[i];
+        // a leading number is the thread count
+        if (i == 1 && positive(opt)) engine->set_threads(int(positive(opt)));
+        else if (opt == "-noponder") ponder = false;
+        else if (opt == "-hash" && i + 1 < argc) {
+            long mb = positive(argv[++i]);
+            if (mb) engine->set_hash(size_t(mb));
+            else error << "-hash needs a positive number of MB, not " << argv[i] << "\n";
+        }
+        else error << "unknown switch " << opt << "\n";
+    }
+
+    std::future<void> searcher;
+    // ends whatever the engine is doing, must come before touching it.
+    // search() clears the stop flag when it starts, so keep setting it.
+    auto halt = [&]() {
+        engine->stop_ponder();
+        if (!searcher.valid()) return;
+        while (searcher.wait_for(std::chrono::milliseconds(1)) != std::future_status::ready) {
+            engine->stop();
+        }
+        searcher.get();
+    };
+    auto go = [&](Position pos, SearchLimits limits) {
+        searcher = std::async(std::launch::async, [&engine, pos, limits]() mutable {
+            info << engine->search(pos, limits);
+        });
+    };
+
+    Position pos;
     while (std::getline(std::cin, line)) {
-        Position pos(line);
-        if(pos.time_left() < -1.0){
-            // not my turn
-            if(pos.count(Hidden) == SQUARE_NB){
-                // opponent is starting first
-                engine->init_game();
-            }
-            else{
-                engine->update_unrevealed(pos);
+        std::istringstream in(line);
+        std::string cmd;
+        in >> cmd;
+
+        if (cmd == "stop") {
+            halt();
+        }
+        else if (cmd == "quit") {
+            break;
+        }
+        else if (cmd == "go") {
+            halt();
+            go(pos, parse_go(in));
+        }
+        else if (cmd == "position") {
+            halt();
+            std::string fen;
+            std::getline(in >> std::ws, fen);
+            pos = Position(fen);
+            // a new game as far as the engine knows, face down is whatever
+            // is not face up on the board
+            engine->init_game();
+            engine->update_unrevealed(pos);
+        }
+        else if (cmd == "setoption") {
+            halt();
+            std::string name, value;
+            in >> cmd >> name >> cmd >> value; // name <name> value <value>
+            long n = positive(value);
+            if (name != "Hash" && name != "Threads") error << "setoption: unknown option " << name << "\n";
+            else if (!n) error << "setoption: " << name << " needs a positive number, not " << value << "\n";
+            else if (name == "Hash") engine->set_hash(size_t(n));
+            else engine->set_threads(int(std::min<long>(n, MAX_THREADS)));
+        }
+        else {
+            // a FEN from the game server
+            halt();
+            pos = Position(line);
+            if (pos.time_left() < -1.0) {
+                // not my turn
+                if (pos.count(Hidden) == SQUARE_NB) {
+                    // opponent is starting first
+                    engine->init_game();
+                }
+                else {
+                    engine->update_unrevealed(pos);
+                    if (ponder) engine->ponder(pos);
+                }
+                continue;
             }
-            continue;
+            go(pos, SearchLimits());
         }
-        Move best_move = engine->search(pos);
-        info << best_move;
-        prev_move = best_move;
     }
+    halt();
 }